@@ -13,17 +13,53 @@
 ---@field get_distribution_version fun(): string
 ---@field get_user_id fun(): string
 ---@field get_time_ms fun(): number
+---@field regex fun(pattern: string, flags?: string): Regex|nil flags: "i" ignore case, "x" extended, "s" dot matches newline
+---@field pattern_set fun(patterns: (string|Regex)[], options?: PatternSetOptions): PatternSet|nil
 ---@field regex_match fun(input: string, pattern: string): boolean
 ---@field regex_search fun(input: string, pattern: string): string[] | nil
 ---@field regex_replace fun(input: string, pattern: string, fmt: string): string
+---@field intern_candidates fun(enable?: boolean)
+---@field dict_cache_usage fun(): DictCacheUsage[] shared ReverseDb / ReverseLookup instances
+---@field set_dict_cache_idle fun(seconds: integer) how long unused ones stay loaded, default 300 (0 on Windows: released once unused); checked when one is loaded or a component is created, so best-effort
+---@field opencc_usage fun(): DictCacheUsage[] shared OpenCC converters by config path, size in approximate bytes
 rime_api = {}
 
+---@class DictCacheUsage
+---@field kind "ReverseDb"|"ReverseLookup"|nil
+---@field key string file path or dict name
+---@field refs integer holders besides the cache
+---@field size integer mapped bytes, 0 if unknown
+---@field idle number seconds since last in use
+
+---@class Regex
+---@field match fun(self: self, input: string): boolean
+---@field search fun(self: self, input: string, init?: integer): string[] | nil
+---@field find fun(self: self, input: string, init?: integer): integer|nil, integer|nil 1-based start and end, like string.find
+---@field capture fun(self: self, input: string, i: integer, init?: integer): string|nil capture i of the match, 0 for the whole match
+---@field replace fun(self: self, input: string, fmt: string): string
+---@field gmatch fun(self: self, input: string): fun(): string|nil, ... like string.gmatch
+
+---@class PatternSetOptions
+---@field regex boolean|nil take the strings as regexes instead of literals
+---@field flags string|nil flags of rime_api.regex for those regexes
+
+---@class PatternSet
+---@field size integer
+---@field match fun(self: self, input: string): integer[] indices of the patterns found, ascending
+---@field match_many fun(self: self, inputs: string[]): integer[][]
+---@field any fun(self: self, input: string): boolean
+
 ---@class Log
 ---@field info fun(string)
 ---@field warning fun(string)
 ---@field error fun(string)
 log = {}
 
+--- OpenCC configs loaded in the background at startup, set in rime.lua;
+--- schemas list theirs under `lua/opencc_preload`
+---@type string[]|nil
+opencc_preload = nil
+
 ---@param cand Candidate
 function yield(cand) end
 
@@ -89,6 +125,7 @@ function Set(values) end
 ---@class Env
 ---@field engine Engine
 ---@field name_space string
+---@field continuation any state kept by `incremental` translators while the input grows (their query cache is disabled)
 
 ---@class Engine
 ---@field schema Schema
@@ -248,6 +285,8 @@ function Schema(schema_id) end
 ---@field get_map fun(self: self, conf_path: string): ConfigMap|nil
 ---@field set_map fun(self: self, conf_path: string, map: ConfigMap): boolean
 ---@field get_list_size fun(self: self, conf_path: string): integer|nil
+---@field to_table fun(self: self, conf_path: string): table|string|nil the subtree at conf_path, scalars as strings
+---@field set_table fun(self: self, conf_path: string, value: table|string|number|boolean): boolean tables with an array part become lists, others maps
 
 ---@class ConfigMap
 ---@field type ConfigType
@@ -441,10 +480,15 @@ function Menu() end
 ---@field convert_text fun(self: self, text: string): string
 ---@field random_convert_text fun(self: self, text: string): string
 ---@field convert_word fun(self: self, text: string): string[]
+---@field convert_many fun(self: self, texts: string[]): string[]
+---@field convert_translation fun(self: self, translation: Translation): Translation
+---@field cache_hits integer
+---@field cache_misses integer
 
 ---@param filename string
+---@param cache_size integer|nil cache the results of this many texts and words
 ---@return Opencc
-function Opencc(filename) end
+function Opencc(filename, cache_size) end
 
 ---@class Dictionary
 ---@field name string
@@ -469,8 +513,16 @@ function Opencc(filename) end
 ---@field size integer
 ---@field iter fun(self: self): fun(): DictEntry|nil
 
+---Results in list order, "" if not found. With annotate, sets the results as
+---comments of the candidates in the list (appended after separator if given)
+---and returns the list.
+---@class LookupManyOptions
+---@field annotate boolean|nil
+---@field separator string|nil
+
 ---@class ReverseDb
 ---@field lookup fun(self: self, key: string): string
+---@field lookup_many fun(self: self, list: (string|Candidate)[], options: LookupManyOptions|nil): (string|Candidate)[]
 
 ---@param file_name string
 ---@return ReverseDb
@@ -479,6 +531,8 @@ function ReverseDb(file_name) end
 ---@class ReverseLookup
 ---@field lookup fun(self: self, key: string): string
 ---@field lookup_stems fun(self: self, key: string): string
+---@field lookup_many fun(self: self, list: (string|Candidate)[], options: LookupManyOptions|nil): (string|Candidate)[]
+---@field lookup_stems_many fun(self: self, list: (string|Candidate)[], options: LookupManyOptions|nil): (string|Candidate)[]
 
 ---@param dict_name string
 ---@return ReverseLookup
@@ -512,6 +566,12 @@ function Code() end
 ---@class Translation
 ---@field exhausted boolean
 ---@field iter fun(self: self): fun(): Candidate|nil
+---@field filter_by_set fun(self: self, texts: Set, keep?: boolean): Translation
+---@field map_comment fun(self: self, comments: table<string, string>|ReverseDb): Translation
+---@field take fun(self: self, count: integer): Translation
+---@field skip fun(self: self, count: integer): Translation
+---@field dedup_by_text fun(self: self): Translation
+---@field stable_partition_by_type fun(self: self, types: Set, limit?: integer): Translation
 
 function Translation() end
 
@@ -634,17 +694,20 @@ Component = {}
 ---@field name_space string
 ---@field apply fun(self: self, translation: Translation): Translation
 
+---@class NotifierOptions
+---@field coalesce boolean|nil call f once per key, with the latest arguments, before the next key reaches a lua_processor (needs one in the schema)
+
 ---@class Notifier
----@field connect fun(self: self, f: fun(ctx: Context), group: integer|nil): Connection
+---@field connect fun(self: self, f: fun(ctx: Context), group: integer|nil, options: NotifierOptions|nil): Connection
 
 ---@class OptionUpdateNotifier: Notifier
----@field connect fun(self: self, f: fun(ctx: Context, name: string), group:integer|nil): function[]
+---@field connect fun(self: self, f: fun(ctx: Context, name: string), group:integer|nil, options: NotifierOptions|nil): function[]
 
 ---@class PropertyUpdateNotifier: Notifier
----@field connect fun(self: self, f: fun(ctx: Context, name: string), group:integer|nil): function[]
+---@field connect fun(self: self, f: fun(ctx: Context, name: string), group:integer|nil, options: NotifierOptions|nil): function[]
 
 ---@class KeyEventNotifier: Notifier
----@field connect fun(self: self, f: fun(ctx: Context, key: string), group:integer|nil): function[]
+---@field connect fun(self: self, f: fun(ctx: Context, key: string), group:integer|nil, options: NotifierOptions|nil): function[]
 
 ---@class Connection
 ---@field disconnect fun(self: self)
@@ -683,6 +746,21 @@ function Switcher(engine) end
 ---@field reset fun(self: self): boolean
 ---@field jump fun(self: self, prefix: string): boolean
 ---@field iter fun(self: self): fun(): (string, string) | nil
+---@field next_batch fun(self: self, n: integer|nil, options: DbBatchOptions|nil): table, integer
+---@field iter_batch fun(self: self, n: integer|nil, options: DbBatchOptions|nil): fun(): (table, integer) | nil
+
+---{ key1, value1, key2, value2, ... }, or { key1, key2, ... } with keys_only
+---@class DbBatchOptions
+---@field table table|nil table to fill instead of a new one
+---@field keys_only boolean|nil
+---@field prefix string|nil end the scan at the first key without this prefix
+
+---@class DbBatch
+---@field size integer
+---@field put fun(self: self, key: string, value: string)
+---@field erase fun(self: self, key: string)
+---@field commit fun(self: self): boolean atomic only on userdb; plain_userdb keeps the writes made before a failed one
+---@field clear fun(self: self)
 
 ---@class UserDb
 ---@field _loaded boolean
@@ -690,6 +768,11 @@ function Switcher(engine) end
 ---@field disabled boolean
 ---@field name string
 ---@field file_name string
+---@field pending integer writes queued by an async db
+---@field cache_hits integer
+---@field cache_misses integer
+---@field cache_size integer
+---@field bloom_skipped integer fetch calls answered by the bloom filter
 ---@field open fun(self: self): boolean
 ---@field open_read_only fun(self: self): boolean
 ---@field close fun(self: self): boolean
@@ -697,23 +780,38 @@ function Switcher(engine) end
 ---@field fetch fun(self: self, key: string): string|nil
 ---@field update fun(self: self, key: string, value: string): boolean
 ---@field erase fun(self: self, key: string): boolean
+---@field batch fun(self: self): DbBatch
+---@field import_tsv fun(self: self, path: string, options: {batch: integer|nil, progress: fun(count: integer)|nil}|nil): integer|nil, string|nil
+---@field export_tsv fun(self: self, path: string, prefix: string|nil, progress: fun(count: integer)|nil): integer|nil, string|nil
+---@field flush fun(self: self)
+---@field clear_cache fun(self: self)
 ---@field loaded fun(self: self): boolean
 ---@field disable fun(self: self): boolean
 ---@field enable fun(self: self): boolean
 
+---@class UserDbOptions
+---@field async boolean|nil queue updates and write them on a background thread (userdb only)
+---@field flush_interval integer|nil milliseconds between writes, default 1000
+---@field cache integer|nil number of fetch results to cache
+---@field bloom boolean|number|nil skip fetching keys ruled out by a bloom filter, with this false positive rate (0.01 if true)
+
+---Handles of the same db_name and db_class share one opened db.
 ---@param db_name string
 ---@param db_class string
+---@param options UserDbOptions|nil
 ---@return UserDb
-function UserDb(db_name, db_class) end
+function UserDb(db_name, db_class, options) end
 
 ---@class LevelDb: UserDb
 
 ---@param db_name string
+---@param options UserDbOptions|nil
 ---@return LevelDb
-function LevelDb(db_name) end
+function LevelDb(db_name, options) end
 
 ---@class TableDb: UserDb
 
 ---@param db_name string
+---@param options UserDbOptions|nil
 ---@return TableDb
-function TableDb(db_name) end
+function TableDb(db_name, options) end
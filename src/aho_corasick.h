@@ -0,0 +1,108 @@
+#ifndef AHO_CORASICK_H
+#define AHO_CORASICK_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Finds every occurrence of a set of byte strings in one pass over a text.
+class AhoCorasick {
+ public:
+  AhoCorasick() : nodes_(1) {}
+
+  void insert(const std::string &key, int id) {
+    int s = 0;
+    for (unsigned char c : key) {
+      auto it = edges_.find(edge(s, c));
+      if (it != edges_.end()) {
+        s = it->second;
+        continue;
+      }
+      int t = (int) nodes_.size();
+      nodes_.emplace_back();
+      nodes_[s].children.emplace_back(c, t);
+      edges_.emplace(edge(s, c), t);
+      s = t;
+    }
+    nodes_[s].ids.push_back(id);
+  }
+
+  // links the trie, required after insertions and before search
+  void build() {
+    std::vector<int> queue(1, 0);
+    for (size_t i = 0; i < queue.size(); ++i) {
+      int s = queue[i];
+      for (const auto &child : nodes_[s].children) {
+        int t = child.second;
+        int f = 0;
+        if (s != 0) {
+          for (f = nodes_[s].fail; ; f = nodes_[f].fail) {
+            auto it = edges_.find(edge(f, child.first));
+            if (it != edges_.end()) {
+              f = it->second;
+              break;
+            }
+            if (f == 0)
+              break;
+          }
+        }
+        nodes_[t].fail = f;
+        nodes_[t].out = f != 0 && !nodes_[f].ids.empty() ? f : nodes_[f].out;
+        queue.push_back(t);
+      }
+    }
+  }
+
+  bool empty() const { return nodes_.size() == 1 && nodes_[0].ids.empty(); }
+
+  // calls found(id) for each occurrence of a key in [begin, end),
+  // the empty key first; stops when found() returns false
+  template <typename F>
+  void search(const char *begin, const char *end, F found) const {
+    for (int id : nodes_[0].ids) {
+      if (!found(id))
+        return;
+    }
+    int s = 0;
+    for (const char *p = begin; p != end; ++p) {
+      unsigned char c = *p;
+      while (true) {
+        auto it = edges_.find(edge(s, c));
+        if (it != edges_.end()) {
+          s = it->second;
+          break;
+        }
+        if (s == 0)
+          break;
+        s = nodes_[s].fail;
+      }
+      for (int o = nodes_[s].ids.empty() ? nodes_[s].out : s; o != 0;
+           o = nodes_[o].out) {
+        for (int id : nodes_[o].ids) {
+          if (!found(id))
+            return;
+        }
+      }
+    }
+  }
+
+ private:
+  struct Node {
+    std::vector<std::pair<unsigned char, int>> children;
+    std::vector<int> ids;
+    int fail = 0;
+    // the nearest node on the fail chain with ids, 0 if none
+    int out = 0;
+  };
+
+  static uint64_t edge(int s, unsigned char c) {
+    return (uint64_t) s << 8 | c;
+  }
+
+  std::vector<Node> nodes_;
+  std::unordered_map<uint64_t, int> edges_;
+};
+
+#endif /* AHO_CORASICK_H */
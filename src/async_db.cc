@@ -0,0 +1,301 @@
+#include "async_db.h"
+#include <algorithm>
+#include <set>
+
+namespace rime {
+
+namespace {
+
+std::mutex registry_mutex;
+std::set<AsyncDb *> registry;
+
+// Merges a snapshot of queued writes into the records of a db accessor.
+class OverlayAccessor : public DbAccessor {
+ public:
+  OverlayAccessor(const string &prefix, an<DbAccessor> accessor,
+                  AsyncDb::Overlay &&overlay)
+      : DbAccessor(prefix), accessor_(accessor), overlay_(std::move(overlay)) {
+    Reset();
+  }
+
+  virtual bool Reset() {
+    bool ok = accessor_->Reset();
+    it_ = overlay_.begin();
+    Advance();
+    return ok;
+  }
+
+  virtual bool Jump(const string &key) {
+    bool ok = accessor_->Jump(key);
+    it_ = overlay_.lower_bound(key);
+    Advance();
+    return ok || it_ != overlay_.end();
+  }
+
+  virtual bool GetNextRecord(string *key, string *value) {
+    while (has_next_ || it_ != overlay_.end()) {
+      if (it_ != overlay_.end() && (!has_next_ || it_->first <= key_)) {
+        // a queued write replaces the stored record
+        if (has_next_ && it_->first == key_)
+          Advance();
+        auto write = it_++;
+        if (write->second.erase)
+          continue;
+        *key = write->first;
+        *value = write->second.value;
+        return true;
+      }
+      key->swap(key_);
+      value->swap(value_);
+      Advance();
+      return true;
+    }
+    return false;
+  }
+
+  virtual bool exhausted() {
+    return !has_next_ && it_ == overlay_.end();
+  }
+
+ private:
+  void Advance() {
+    has_next_ = accessor_->GetNextRecord(&key_, &value_);
+  }
+
+  an<DbAccessor> accessor_;
+  AsyncDb::Overlay overlay_;
+  AsyncDb::Overlay::iterator it_;
+  bool has_next_ = false;
+  string key_;
+  string value_;
+};
+
+void collect(const AsyncDb::Overlay &from, const string &prefix,
+             AsyncDb::Overlay *to) {
+  for (auto it = from.lower_bound(prefix);
+       it != from.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+       ++it) {
+    // pending writes are newer than inflight ones
+    (*to)[it->first] = it->second;
+  }
+}
+
+}  // namespace
+
+AsyncDb::AsyncDb(an<SharedDb> db, std::chrono::milliseconds interval)
+    : Db(DbPath<Db>::of(*db), db->name()),
+      db_(db),
+      interval_(interval),
+      io_mutex_(db->io_mutex()) {
+  Sync(true);
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.insert(this);
+}
+
+AsyncDb::~AsyncDb() {
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.erase(this);
+  }
+  Stop();
+  Flush();
+}
+
+void AsyncDb::FlushAll() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (auto db : registry)
+    db->Flush();
+}
+
+bool AsyncDb::Sync(bool ok) {
+  loaded_ = db_->loaded();
+  readonly_ = db_->readonly();
+  if (loaded_ && !readonly_)
+    Start();
+  return ok;
+}
+
+void AsyncDb::Start() {
+  if (worker_.joinable())
+    return;
+  stop_ = false;
+  worker_ = std::thread(&AsyncDb::Run, this);
+}
+
+void AsyncDb::Stop() {
+  if (!worker_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+void AsyncDb::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    cv_.wait_for(lock, interval_, [this] { return stop_; });
+    lock.unlock();
+    Flush();
+    lock.lock();
+  }
+}
+
+void AsyncDb::Flush() {
+  std::lock_guard<std::mutex> io(io_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.empty())
+      return;
+    inflight_.swap(pending_);
+  }
+  bool batched = !db_->in_transaction() && db_->BeginTransaction();
+  size_t failed = 0;
+  for (const auto &w : inflight_) {
+    if (!(w.second.erase ? db_->Erase(w.first)
+                         : db_->Update(w.first, w.second.value)))
+      ++failed;
+  }
+  if (batched && !db_->CommitTransaction())
+    failed = inflight_.size();
+  if (failed)
+    LOG(ERROR) << "AsyncDb " << name() << ": " << failed << " of "
+               << inflight_.size() << " writes failed.";
+  std::lock_guard<std::mutex> lock(mutex_);
+  inflight_.clear();
+}
+
+size_t AsyncDb::pending() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size() + inflight_.size();
+}
+
+// the shared db takes io_mutex_ itself for opening, closing, backing up
+// and restoring
+bool AsyncDb::Open() {
+  return Sync(db_->Open());
+}
+
+bool AsyncDb::OpenReadOnly() {
+  return Sync(db_->OpenReadOnly());
+}
+
+bool AsyncDb::Close() {
+  AbortTransaction();
+  Stop();
+  Flush();
+  return Sync(db_->Close());
+}
+
+bool AsyncDb::Backup(const db_path &snapshot_file) {
+  Flush();
+  return db_->Backup(snapshot_file);
+}
+
+bool AsyncDb::Restore(const db_path &snapshot_file) {
+  {
+    // restored records supersede queued writes
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.clear();
+    transaction_writes_.clear();
+  }
+  return db_->Restore(snapshot_file);
+}
+
+bool AsyncDb::CreateMetadata() {
+  return db_->CreateMetadata();
+}
+
+bool AsyncDb::MetaFetch(const string &key, string *value) {
+  return db_->MetaFetch(key, value);
+}
+
+bool AsyncDb::MetaUpdate(const string &key, const string &value) {
+  return db_->MetaUpdate(key, value);
+}
+
+an<DbAccessor> AsyncDb::QueryMetadata() {
+  return db_->QueryMetadata();
+}
+
+an<DbAccessor> AsyncDb::QueryAll() {
+  Flush();
+  return db_->QueryAll();
+}
+
+an<DbAccessor> AsyncDb::Query(const string &key) {
+  Overlay overlay;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    collect(inflight_, key, &overlay);
+    collect(pending_, key, &overlay);
+    collect(transaction_writes_, key, &overlay);
+  }
+  auto accessor = db_->Query(key);
+  if (!accessor || overlay.empty())
+    return accessor;
+  return New<OverlayAccessor>(key, accessor, std::move(overlay));
+}
+
+bool AsyncDb::Fetch(const string &key, string *value) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto overlay : {&transaction_writes_, &pending_, &inflight_}) {
+      auto it = overlay->find(key);
+      if (it != overlay->end()) {
+        if (it->second.erase)
+          return false;
+        *value = it->second.value;
+        return true;
+      }
+    }
+  }
+  return db_->Fetch(key, value);
+}
+
+bool AsyncDb::Update(const string &key, const string &value) {
+  if (!loaded() || readonly())
+    return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  (in_transaction() ? transaction_writes_ : pending_)[key] = {false, value};
+  return true;
+}
+
+bool AsyncDb::Erase(const string &key) {
+  if (!loaded() || readonly())
+    return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  (in_transaction() ? transaction_writes_ : pending_)[key] = {true, string()};
+  return true;
+}
+
+bool AsyncDb::BeginTransaction() {
+  if (!loaded() || readonly() || in_transaction())
+    return false;
+  transaction_ = true;
+  return true;
+}
+
+bool AsyncDb::AbortTransaction() {
+  if (!in_transaction())
+    return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  transaction_writes_.clear();
+  transaction_ = false;
+  return true;
+}
+
+bool AsyncDb::CommitTransaction() {
+  if (!in_transaction())
+    return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &w : transaction_writes_)
+    pending_[w.first] = std::move(w.second);
+  transaction_writes_.clear();
+  transaction_ = false;
+  return true;
+}
+
+}  // namespace rime
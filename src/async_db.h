@@ -0,0 +1,94 @@
+#ifndef ASYNC_DB_H
+#define ASYNC_DB_H
+
+#include <rime/common.h>
+#include <rime/dict/db.h>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include "db_compat.h"
+#include "shared_db.h"
+
+namespace rime {
+
+// Write-behind wrapper of a SharedDb.
+// Update() and Erase() go to a queue that a background thread writes
+// to the shared db every `interval`, in one transaction.
+// Fetch() and Query() see queued writes.
+// The queue is flushed on Close(), Backup(), destruction and FlushAll().
+// The shared db must be transactional (LevelDb), as it is then safe to
+// read while the background thread writes to it. A flush holds the
+// shared db's io_mutex(), so no handle opens, closes, backs up or
+// restores it meanwhile.
+// Writes in a transaction are held apart and queued together on commit,
+// so they reach the db in the same flush.
+class AsyncDb : public Db, public Transactional {
+ public:
+  AsyncDb(an<SharedDb> db, std::chrono::milliseconds interval);
+  virtual ~AsyncDb();
+
+  virtual bool Open();
+  virtual bool OpenReadOnly();
+  virtual bool Close();
+
+  virtual bool Backup(const db_path &snapshot_file);
+  virtual bool Restore(const db_path &snapshot_file);
+
+  virtual bool CreateMetadata();
+  virtual bool MetaFetch(const string &key, string *value);
+  virtual bool MetaUpdate(const string &key, const string &value);
+
+  virtual an<DbAccessor> QueryMetadata();
+  virtual an<DbAccessor> QueryAll();
+  virtual an<DbAccessor> Query(const string &key);
+  virtual bool Fetch(const string &key, string *value);
+  virtual bool Update(const string &key, const string &value);
+  virtual bool Erase(const string &key);
+
+  virtual bool BeginTransaction();
+  virtual bool AbortTransaction();
+  virtual bool CommitTransaction();
+
+  // writes queued updates to the underlying db
+  void Flush();
+  size_t pending() const;
+  an<Db> db() const { return db_; }
+
+  // flushes every live AsyncDb, called on module finalization
+  static void FlushAll();
+
+  struct Write {
+    bool erase;
+    string value;
+  };
+  // latest queued write of each key
+  using Overlay = std::map<string, Write>;
+
+ private:
+  bool Sync(bool ok);
+  void Start();
+  void Stop();
+  void Run();
+
+  an<SharedDb> db_;
+  std::chrono::milliseconds interval_;
+
+  // guards pending_, inflight_, transaction_writes_ and stop_
+  mutable std::mutex mutex_;
+  // db_->io_mutex(), serializing flushes with every handle of the db
+  std::mutex &io_mutex_;
+  std::condition_variable cv_;
+  Overlay pending_;
+  Overlay inflight_;
+  // writes of the current transaction
+  Overlay transaction_writes_;
+  bool stop_ = false;
+  std::thread worker_;
+};
+
+}  // namespace rime
+
+#endif /* ASYNC_DB_H */
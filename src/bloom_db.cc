@@ -0,0 +1,139 @@
+#include "bloom_db.h"
+#include <algorithm>
+
+namespace rime {
+
+BloomDb::BloomDb(an<Db> db, double fp_rate)
+    : ProxyDb(db),
+      fp_rate_(fp_rate),
+      background_(dynamic_cast<Transactional *>(db.get()) != nullptr) {
+  if (loaded())
+    Rebuild();
+}
+
+BloomDb::~BloomDb() {
+  Stop();
+}
+
+size_t BloomDb::skipped() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return skipped_;
+}
+
+void BloomDb::Rebuild() {
+  Stop();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    filter_ = BloomFilter();
+    building_ = true;
+  }
+  if (background_)
+    builder_ = std::thread(&BloomDb::Build, this);
+  else
+    Build();
+}
+
+void BloomDb::Stop() {
+  if (!builder_.joinable())
+    return;
+  cancel_ = true;
+  builder_.join();
+  cancel_ = false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  building_ = false;
+  written_.clear();
+}
+
+void BloomDb::Build() {
+  size_t capacity;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // leave room to grow before rebuilding
+    capacity = std::max<size_t>(1024, keys_ * 2);
+  }
+  while (!cancel_) {
+    BloomFilter filter(capacity, fp_rate_);
+    auto accessor = db_->QueryAll();
+    string key, value;
+    while (accessor && !filter.full() && !cancel_ &&
+           accessor->GetNextRecord(&key, &value))
+      filter.insert(key);
+    if (filter.full()) {
+      capacity *= 2;
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancel_)
+      return;
+    keys_ = filter.size();
+    for (const auto &key : written_)
+      filter.insert(key);
+    written_.clear();
+    filter_ = std::move(filter);
+    building_ = false;
+    return;
+  }
+}
+
+bool BloomDb::Open() {
+  bool ok = ProxyDb::Open();
+  if (ok)
+    Rebuild();
+  return ok;
+}
+
+bool BloomDb::OpenReadOnly() {
+  bool ok = ProxyDb::OpenReadOnly();
+  if (ok)
+    Rebuild();
+  return ok;
+}
+
+bool BloomDb::Close() {
+  Stop();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    filter_ = BloomFilter();
+  }
+  return ProxyDb::Close();
+}
+
+bool BloomDb::Restore(const db_path &snapshot_file) {
+  Stop();
+  bool ok = ProxyDb::Restore(snapshot_file);
+  if (loaded())
+    Rebuild();
+  return ok;
+}
+
+bool BloomDb::Fetch(const string &key, string *value) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!filter_.may_contain(key)) {
+      ++skipped_;
+      return false;
+    }
+  }
+  return db_->Fetch(key, value);
+}
+
+bool BloomDb::Update(const string &key, const string &value) {
+  if (!db_->Update(key, value))
+    return false;
+  {
+    // a build in progress may have read past this key
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (building_) {
+      written_.push_back(key);
+      return true;
+    }
+    filter_.insert(key);
+    if (!filter_.full())
+      return true;
+    keys_ = filter_.size();
+  }
+  Rebuild();
+  return true;
+}
+
+}  // namespace rime
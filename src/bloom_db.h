@@ -0,0 +1,63 @@
+#ifndef BLOOM_DB_H
+#define BLOOM_DB_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "bloom_filter.h"
+#include "proxy_db.h"
+
+namespace rime {
+
+// Answers Fetch() of keys not in the db without reading it,
+// using a Bloom filter of its keys built when the db is opened
+// and kept up to date by writes through this object.
+// The filter of a transactional db (LevelDb) is built on a background
+// thread, and Fetch() reads the db until it is ready; others are read
+// on the thread opening them.
+// The filter may be used from an AsyncDb worker and the caller's thread;
+// Open(), Close(), Restore() and Update() are not called concurrently,
+// which SharedDb ensures.
+class BloomDb : public ProxyDb {
+ public:
+  BloomDb(an<Db> db, double fp_rate);
+  virtual ~BloomDb();
+
+  virtual bool Open();
+  virtual bool OpenReadOnly();
+  virtual bool Close();
+  virtual bool Restore(const db_path &snapshot_file);
+
+  virtual bool Fetch(const string &key, string *value);
+  virtual bool Update(const string &key, const string &value);
+
+  // Fetch() calls answered by the filter alone
+  size_t skipped() const;
+
+ private:
+  // drops the filter and builds a new one
+  void Rebuild();
+  // cancels a build in progress
+  void Stop();
+  // inserts every key of the db into a new filter
+  void Build();
+
+  double fp_rate_;
+  bool background_;
+  // guards filter_, building_, written_, keys_ and skipped_
+  mutable std::mutex mutex_;
+  // empty while building
+  BloomFilter filter_;
+  bool building_ = false;
+  // keys updated while building
+  vector<string> written_;
+  // keys in the db at the last build, to size the next one
+  size_t keys_ = 0;
+  size_t skipped_ = 0;
+  std::atomic<bool> cancel_{false};
+  std::thread builder_;
+};
+
+}  // namespace rime
+
+#endif /* BLOOM_DB_H */
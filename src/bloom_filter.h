@@ -0,0 +1,73 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A set of strings that may report false positives but no false negatives.
+class BloomFilter {
+ public:
+  BloomFilter() = default;
+
+  // sized for `capacity` keys at the false positive rate `fp_rate`
+  BloomFilter(size_t capacity, double fp_rate) : capacity_(capacity) {
+    const double ln2 = std::log(2.0);
+    double n = (double) (capacity ? capacity : 1);
+    size_t m = (size_t) std::ceil(-n * std::log(fp_rate) / (ln2 * ln2));
+    bits_.assign((std::max<size_t>(m, 64) + 63) / 64, 0);
+    hashes_ = std::max(1, (int) std::round(ln2 * bits() / n));
+  }
+
+  void insert(const std::string &key) {
+    uint64_t h1, h2;
+    hash(key, &h1, &h2);
+    for (int i = 0; i < hashes_; ++i) {
+      size_t bit = (h1 + i * h2) % bits();
+      bits_[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+    ++size_;
+  }
+
+  bool may_contain(const std::string &key) const {
+    if (bits_.empty())
+      return true;
+    uint64_t h1, h2;
+    hash(key, &h1, &h2);
+    for (int i = 0; i < hashes_; ++i) {
+      size_t bit = (h1 + i * h2) % bits();
+      if (!(bits_[bit / 64] & (uint64_t(1) << (bit % 64))))
+        return false;
+    }
+    return true;
+  }
+
+  // keys inserted, counting duplicates
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  size_t bits() const { return bits_.size() * 64; }
+  bool full() const { return size_ > capacity_; }
+
+ private:
+  static void hash(const std::string &key, uint64_t *h1, uint64_t *h2) {
+    *h1 = std::hash<std::string>()(key);
+    // FNV-1a as the second, independent hash
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : key) {
+      h ^= c;
+      h *= 1099511628211ull;
+    }
+    *h2 = h | 1;
+  }
+
+  std::vector<uint64_t> bits_;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  int hashes_ = 0;
+};
+
+#endif /* BLOOM_FILTER_H */
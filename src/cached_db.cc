@@ -0,0 +1,99 @@
+#include "cached_db.h"
+
+namespace rime {
+
+CachedDb::CachedDb(an<Db> db, size_t capacity, an<SharedDb> shared)
+    : ProxyDb(db),
+      cache_(capacity),
+      shared_(shared),
+      generation_(shared ? shared->generation() : 0) {}
+
+uint64_t CachedDb::Validate() {
+  if (!shared_)
+    return 0;
+  uint64_t generation = shared_->generation();
+  if (generation != generation_) {
+    cache_.clear();
+    generation_ = generation;
+  }
+  return generation;
+}
+
+// A write that went straight to the shared db is one generation; if
+// that is all that changed, the cache stays. Writes queued by an AsyncDb
+// in between change it later, when they are flushed.
+void CachedDb::Written(uint64_t before, bool ok) {
+  if (shared_ && ok && db_ == shared_ && shared_->generation() == before + 1)
+    generation_ = before + 1;
+}
+
+bool CachedDb::Open() {
+  cache_.clear();
+  return ProxyDb::Open();
+}
+
+bool CachedDb::OpenReadOnly() {
+  cache_.clear();
+  return ProxyDb::OpenReadOnly();
+}
+
+bool CachedDb::Close() {
+  cache_.clear();
+  return ProxyDb::Close();
+}
+
+bool CachedDb::Restore(const db_path &snapshot_file) {
+  cache_.clear();
+  return ProxyDb::Restore(snapshot_file);
+}
+
+bool CachedDb::Fetch(const string &key, string *value) {
+  uint64_t generation = Validate();
+  if (auto entry = cache_.get(key)) {
+    if (entry->found)
+      *value = entry->value;
+    return entry->found;
+  }
+  string res;
+  bool found = db_->Fetch(key, &res);
+  // an unloaded db finds nothing, don't remember that
+  if (!loaded())
+    return false;
+  if (found)
+    *value = res;
+  // nor what another handle may have overwritten meanwhile
+  if (Validate() == generation)
+    cache_.put(key, {found, std::move(res)});
+  return found;
+}
+
+bool CachedDb::Update(const string &key, const string &value) {
+  uint64_t generation = Validate();
+  bool ok = db_->Update(key, value);
+  Written(generation, ok);
+  if (!ok) {
+    cache_.erase(key);
+    return false;
+  }
+  cache_.put(key, {true, value});
+  return true;
+}
+
+bool CachedDb::Erase(const string &key) {
+  uint64_t generation = Validate();
+  bool ok = db_->Erase(key);
+  Written(generation, ok);
+  if (ok)
+    cache_.put(key, {false, string()});
+  else
+    cache_.erase(key);
+  return ok;
+}
+
+bool CachedDb::AbortTransaction() {
+  // the cache has the writes rolled back
+  cache_.clear();
+  return ProxyDb::AbortTransaction();
+}
+
+}  // namespace rime
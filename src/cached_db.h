@@ -0,0 +1,55 @@
+#ifndef CACHED_DB_H
+#define CACHED_DB_H
+
+#include "lru_cache.h"
+#include "proxy_db.h"
+#include "shared_db.h"
+
+namespace rime {
+
+// Read-through cache of Fetch() results, found or not, in front of a Db.
+// Writes through this object keep the cache up to date. If `shared` is
+// the SharedDb that db is or wraps, the cache is dropped once another
+// handle writes to it; writes made to any other db elsewhere are not
+// seen until evicted.
+class CachedDb : public ProxyDb {
+ public:
+  CachedDb(an<Db> db, size_t capacity, an<SharedDb> shared = nullptr);
+
+  virtual bool Open();
+  virtual bool OpenReadOnly();
+  virtual bool Close();
+  virtual bool Restore(const db_path &snapshot_file);
+
+  virtual bool Fetch(const string &key, string *value);
+  virtual bool Update(const string &key, const string &value);
+  virtual bool Erase(const string &key);
+
+  virtual bool AbortTransaction();
+
+  void Clear() { cache_.clear(); }
+  size_t hits() const { return cache_.hits(); }
+  size_t misses() const { return cache_.misses(); }
+  size_t size() const { return cache_.size(); }
+  size_t capacity() const { return cache_.capacity(); }
+  void Resize(size_t capacity) { cache_.resize(capacity); }
+
+ private:
+  struct Entry {
+    bool found;
+    string value;
+  };
+
+  // drops the cache if shared_ changed since it was filled
+  uint64_t Validate();
+  // after a write through this object that began at generation `before`
+  void Written(uint64_t before, bool ok);
+
+  LruCache<string, Entry> cache_;
+  an<SharedDb> shared_;
+  uint64_t generation_ = 0;
+};
+
+}  // namespace rime
+
+#endif /* CACHED_DB_H */
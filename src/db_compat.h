@@ -0,0 +1,29 @@
+#ifndef DB_COMPAT_H
+#define DB_COMPAT_H
+
+#include <rime/dict/db.h>
+#include <type_traits>
+#include <utility>
+
+namespace rime {
+
+// Db::Backup()/Restore() take rime::path on recent librime, string before
+template <typename> struct db_void { using type = void; };
+
+template <typename T, typename = void>
+struct DbPath {
+  using type = std::decay_t<decltype(std::declval<T>().file_name())>;
+  static const type &of(const T &t) { return t.file_name(); }
+};
+
+template <typename T>
+struct DbPath<T, typename db_void<decltype(std::declval<T>().file_path())>::type> {
+  using type = std::decay_t<decltype(std::declval<T>().file_path())>;
+  static const type &of(const T &t) { return t.file_path(); }
+};
+
+using db_path = DbPath<Db>::type;
+
+}  // namespace rime
+
+#endif /* DB_COMPAT_H */
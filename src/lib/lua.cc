@@ -228,6 +228,8 @@ Lua::Lua() {
 }
 
 Lua::~Lua() {
+  // deferred calls may hold references into the state
+  deferred_.clear();
   lua_close(L_);
 }
 
@@ -244,6 +246,18 @@ void Lua::to_state(std::function<void (lua_State *)> f) {
   f(L_);
 }
 
+void Lua::defer(std::function<void ()> f) {
+  deferred_.push_back(std::move(f));
+}
+
+void Lua::run_deferred() {
+  // calls deferred while running wait for the next run
+  std::vector<std::function<void ()>> fs;
+  fs.swap(deferred_);
+  for (auto &f : fs)
+    f();
+}
+
 std::shared_ptr<LuaObj> Lua::newthreadx(lua_State *L, int nargs) {
   lua_State *C = lua_newthread(L_);
   auto o = LuaObj::todata(L_, -1);
@@ -4,6 +4,7 @@
 #include <memory>
 #include <functional>
 #include <string>
+#include <vector>
 #include "result.h"
 
 struct lua_State;
@@ -42,17 +43,32 @@ public:
   template <typename O>
   LuaResult<O> resume(std::shared_ptr<LuaObj> f);
 
+  template <typename O>
+  LuaResult<O> result(std::shared_ptr<LuaObj> f);
+
   template <typename O, typename ... I>
   LuaResult<O> call(I ... input);
 
   template <typename ... I>
   LuaResult<void> void_call(I ... input);
 
+  typedef std::vector<std::pair<std::shared_ptr<LuaObj>,
+                                std::shared_ptr<LuaObj>>> Chain;
+
+  template <typename O>
+  LuaResult<O> chain_call(O o, Chain &fs, size_t first = 0);
+
   void to_state(std::function<void (lua_State *)> f);
 
+  // queues f for the next run_deferred(), which lua_processor calls
+  // before handling a key
+  void defer(std::function<void ()> f);
+  void run_deferred();
+
   static Lua *from_state(lua_State *L);
 private:
   lua_State *L_;
+  std::vector<std::function<void ()>> deferred_;
 };
 
 namespace LuaImpl {
@@ -92,6 +92,12 @@ struct LUAWRAPPER_LOCAL LuaType {
     static bool pushnil(lua_State *L, U &o) {
       return false;
     }
+
+    static bool pushcached(lua_State *L, U &o) {
+      return false;
+    }
+
+    static void cache(lua_State *L, U &o) {}
   };
 
   template<typename U>
@@ -102,6 +108,12 @@ struct LUAWRAPPER_LOCAL LuaType {
       lua_pushnil(L);
       return true;
     }
+
+    static bool pushcached(lua_State *L, U *o) {
+      return false;
+    }
+
+    static void cache(lua_State *L, U *o) {}
   };
 
   template<typename U>
@@ -112,11 +124,70 @@ struct LUAWRAPPER_LOCAL LuaType {
       lua_pushnil(L);
       return true;
     }
+
+    // If interning is enabled for T, pushes the userdata
+    // already holding o.get() and returns true.
+    static bool pushcached(lua_State *L, std::shared_ptr<U> &o) {
+      if (!pushintern(L))
+        return false;
+      lua_pushlightuserdata(L, (void *) o.get());
+      lua_rawget(L, -2);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        return false;
+      }
+      lua_remove(L, -2);
+      return true;
+    }
+
+    // Remembers the userdata on the top of the stack.
+    static void cache(lua_State *L, std::shared_ptr<U> &o) {
+      if (!pushintern(L))
+        return;
+      lua_pushlightuserdata(L, (void *) o.get());
+      lua_pushvalue(L, -3);
+      lua_rawset(L, -3);
+      lua_pop(L, 1);
+    }
   };
 
+  static bool pushintern(lua_State *L) {
+    lua_pushlightuserdata(L, (void *) type());
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      return false;
+    }
+    return true;
+  }
+
+  // Interning: the same object is pushed as the same userdata
+  // as long as Lua holds a reference to it. The userdata are kept
+  // in a weak-valued table in the registry, keyed by the raw pointer.
+  // Only takes effect for shared pointers.
+  static void set_intern(lua_State *L, bool enable) {
+    if (enable && pushintern(L)) {
+      lua_pop(L, 1);
+      return;
+    }
+    lua_pushlightuserdata(L, (void *) type());
+    if (enable) {
+      lua_createtable(L, 0, 0);
+      lua_createtable(L, 0, 1);
+      lua_pushstring(L, "v");
+      lua_setfield(L, -2, "__mode");
+      lua_setmetatable(L, -2);
+    } else {
+      lua_pushnil(L);
+    }
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+
   static void pushdata(lua_State *L, T &o) {
     if (X<T>::pushnil(L, o))
       return;
+    if (X<T>::pushcached(L, o))
+      return;
 
     void *u = lua_newuserdata(L, sizeof(T));
     new(u) T(o);
@@ -132,6 +203,7 @@ struct LUAWRAPPER_LOCAL LuaType {
       lua_setfield(L, -2, "__gc");
     }
     lua_setmetatable(L, -2);
+    X<T>::cache(L, o);
   }
 
   static T &todata(lua_State *L, int i, C_State * = NULL) {
@@ -502,6 +574,21 @@ LuaResult<O> Lua::resume(std::shared_ptr<LuaObj> f) {
   }
 }
 
+// Value returned by a finished thread
+template <typename O>
+LuaResult<O> Lua::result(std::shared_ptr<LuaObj> f) {
+  LuaObj::pushdata(L_, f);
+  lua_State *C = lua_tothread(L_, -1);
+  lua_pop(L_, 1);
+
+  if (lua_gettop(C) == 0)
+    return LuaResult<O>::Err({LUA_OK, ""});
+
+  auto r = todata_safe<O>(C, -1);
+  lua_settop(C, 0);
+  return r;
+}
+
 template <typename O, typename ... I>
 LuaResult<O> Lua::call(I ... input) {
   pushdataX<I ...>(L_, input ...);
@@ -532,6 +619,34 @@ LuaResult<void> Lua::void_call(I ... input) {
   return LuaResult<void>::Ok();
 }
 
+// Calls the (function, env) pairs in fs in turn, starting from
+// fs[first], as o = f(o, env). The value stays on the Lua stack between
+// the calls, so o is converted only once in each direction. A nil
+// result stops the chain and is returned as O().
+template <typename O>
+LuaResult<O> Lua::chain_call(O o, Chain &fs, size_t first) {
+  LuaType<O>::pushdata(L_, o);
+  for (size_t i = first; i < fs.size() && !lua_isnil(L_, -1); i++) {
+    LuaObj::pushdata(L_, fs[i].first);
+    lua_insert(L_, -2);
+    LuaObj::pushdata(L_, fs[i].second);
+    int status = lua_pcall(L_, 2, 1, 0);
+    if (status != LUA_OK) {
+      std::string e = lua_tostring(L_, -1);
+      lua_pop(L_, 1);
+      return LuaResult<O>::Err({status, e});
+    }
+  }
+
+  if (lua_isnil(L_, -1)) {
+    lua_pop(L_, 1);
+    return LuaResult<O>::Ok(O());
+  }
+  auto r = todata_safe<O>(L_, -1);
+  lua_pop(L_, 1);
+  return r;
+}
+
 // --- LuaWrapper
 // WRAP(f): wraps function f
 // WRAPMEM(C::f): wraps member function C::f
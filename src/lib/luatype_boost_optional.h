@@ -14,7 +14,7 @@ struct LuaType<boost::optional<T>> {
   }
 
   static boost::optional<T> &todata(lua_State *L, int i, C_State *C) {
-    if (lua_type(L, i) == LUA_TNIL)
+    if (lua_isnoneornil(L, i))
       return C->alloc<boost::optional<T>>();
     else
       return C->alloc<boost::optional<T>>(LuaType<T>::todata(L, i, C));
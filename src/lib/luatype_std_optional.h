@@ -14,7 +14,7 @@ struct LuaType<std::optional<T>> {
   }
 
   static std::optional<T> &todata(lua_State *L, int i, C_State *C) {
-    if (lua_type(L, i) == LUA_TNIL)
+    if (lua_isnoneornil(L, i))
       return C->alloc<std::optional<T>>();
     else
       return C->alloc<std::optional<T>>(LuaType<T>::todata(L, i, C));
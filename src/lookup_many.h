@@ -0,0 +1,100 @@
+#ifndef LOOKUP_MANY_H
+#define LOOKUP_MANY_H
+
+#include <rime/candidate.h>
+#include <rime/gear/translator_commons.h>
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#include "lib/lua_templates.h"
+
+// db:lookup_many(list[, options])
+// list holds keys or candidates, whose text is the key.
+// Keys are looked up in sorted order, each distinct key once.
+// return an array of results in list order, "" for keys not found;
+// with options.annotate, the found results become the comments of the
+// candidates in list instead, separated from the old comment by
+// options.separator if given, and list is returned.
+// `lookup(key, &result)` returns whether the key was found.
+template <typename F>
+int raw_lookup_many(lua_State *L, F lookup) {
+  using namespace rime;
+  C_State C;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  bool annotate = false;
+  const char *separator = NULL;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "annotate");
+    annotate = lua_toboolean(L, -1);
+    lua_getfield(L, 3, "separator");
+    if (lua_isstring(L, -1))
+      separator = lua_tostring(L, -1);
+  }
+
+  const int n = (int) lua_rawlen(L, 2);
+  auto &keys = C.alloc<std::vector<string>>(n);
+  auto &cands = C.alloc<std::vector<an<Candidate>>>(n);
+  for (int i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      keys[i] = lua_tostring(L, -1);
+    } else if (lua_isuserdata(L, -1)) {
+      cands[i] = LuaType<an<Candidate>>::todata(L, -1);
+      if (cands[i])
+        keys[i] = cands[i]->text();
+    }
+    lua_pop(L, 1);
+  }
+
+  auto &order = C.alloc<std::vector<int>>(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&keys](int a, int b) { return keys[a] < keys[b]; });
+  auto &results = C.alloc<std::vector<string>>(n);
+  auto &found = C.alloc<std::vector<char>>(n);
+  for (int k = 0; k < n; k++) {
+    int i = order[k];
+    if (keys[i].empty())
+      continue;
+    if (k > 0 && keys[order[k - 1]] == keys[i]) {
+      results[i] = results[order[k - 1]];
+      found[i] = found[order[k - 1]];
+      continue;
+    }
+    found[i] = lookup(keys[i], &results[i]);
+    if (!found[i])
+      results[i].clear();
+  }
+
+  if (!annotate) {
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+      lua_pushstring(L, results[i].c_str());
+      lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    auto &cand = cands[i];
+    if (!cand || !found[i])
+      continue;
+    string comment = results[i];
+    if (separator && !cand->comment().empty())
+      comment = cand->comment() + separator + comment;
+    if (auto p = As<Phrase>(cand)) {
+      p->set_comment(comment);
+    } else if (auto p = As<SimpleCandidate>(cand)) {
+      p->set_comment(comment);
+    } else {
+      an<Candidate> shadow =
+          New<ShadowCandidate>(cand, cand->type(), string(), comment);
+      LuaType<an<Candidate>>::pushdata(L, shadow);
+      lua_rawseti(L, 2, i + 1);
+    }
+  }
+  lua_pushvalue(L, 2);
+  return 1;
+}
+
+#endif /* LOOKUP_MANY_H */
@@ -0,0 +1,84 @@
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// A bounded map that evicts the least recently used entry.
+// A capacity of 0 disables the cache.
+template <typename K, typename V, typename H = std::hash<K>>
+class LruCache {
+public:
+  explicit LruCache(size_t capacity = 0) : capacity_(capacity) {}
+
+  // returns nullptr on miss
+  V *get(const K &key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      misses_++;
+      return nullptr;
+    }
+    hits_++;
+    items_.splice(items_.begin(), items_, it->second);
+    return &it->second->second;
+  }
+
+  V *put(const K &key, V value) {
+    if (capacity_ == 0)
+      return nullptr;
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      it->second->second = std::move(value);
+      items_.splice(items_.begin(), items_, it->second);
+      return &it->second->second;
+    }
+    if (items_.size() >= capacity_)
+      pop_back();
+    items_.emplace_front(key, std::move(value));
+    index_.emplace(key, items_.begin());
+    return &items_.front().second;
+  }
+
+  bool erase(const K &key) {
+    auto it = index_.find(key);
+    if (it == index_.end())
+      return false;
+    items_.erase(it->second);
+    index_.erase(it);
+    return true;
+  }
+
+  void clear() {
+    index_.clear();
+    items_.clear();
+  }
+
+  void resize(size_t capacity) {
+    capacity_ = capacity;
+    while (items_.size() > capacity_)
+      pop_back();
+  }
+
+  size_t size() const { return items_.size(); }
+  size_t capacity() const { return capacity_; }
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+private:
+  using List = std::list<std::pair<K, V>>;
+
+  void pop_back() {
+    index_.erase(items_.back().first);
+    items_.pop_back();
+  }
+
+  size_t capacity_;
+  List items_;
+  std::unordered_map<K, typename List::iterator, H> index_;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
+
+#endif /* LRU_CACHE_H */
@@ -1,7 +1,12 @@
+#include <rime/context.h>
+#include <rime/engine.h>
+#include <rime/gear/translator_commons.h>
 #include "lib/lua_templates.h"
 #include "lua_gears.h"
 #include <vector>
 #include <sstream>
+#include <chrono>
+#include <typeinfo>
 
 namespace rime {
 
@@ -10,11 +15,29 @@ bool LuaTranslation::Next() {
   if (exhausted()) {
     return false;
   }
+  if (t_) {
+    t_->Next();
+    if (t_->exhausted()) {
+      set_exhausted(true);
+      return false;
+    }
+    c_ = t_->Peek();
+    return true;
+  }
   auto r = lua_->resume<an<Candidate>>(f_);
   if (!r.ok()) {
     LuaErr e = r.get_err();
-    if (e.e != "")
+    if (e.e != "") {
       LOG(ERROR) << "LuaTranslation::Next error(" << e.status << "): " << e.e;
+    } else {
+      // the generator may return a (native) translation to continue with
+      auto t = lua_->result<an<Translation>>(f_);
+      if (t.ok() && t.get() && !t.get()->exhausted()) {
+        t_ = t.get();
+        c_ = t_->Peek();
+        return true;
+      }
+    }
     set_exhausted(true);
     return false;
   } else {
@@ -27,6 +50,62 @@ LuaTranslation::~LuaTranslation() {
   lua_->gc();
 }
 
+//--- LuaMapTranslation
+LuaMapTranslation::LuaMapTranslation(Lua *lua, an<Translation> translation,
+                                     an<LuaObj> map, an<LuaObj> env)
+  : lua_(lua), translation_(translation) {
+  stages_.emplace_back(map, env);
+  Replenish();
+}
+
+bool LuaMapTranslation::Fuse(Lua *lua, an<LuaObj> map, an<LuaObj> env) {
+  if (lua != lua_ || started_)
+    return false;
+  stages_.emplace_back(map, env);
+  if (exhausted())
+    return true;
+  // the current candidate has passed the previous stages already
+  auto r = lua_->chain_call<an<Candidate>>(c_, stages_, stages_.size() - 1);
+  if (!r.ok()) {
+    LuaErr e = r.get_err();
+    LOG(ERROR) << "LuaMapTranslation error(" << e.status << "): " << e.e;
+  } else if (r.get()) {
+    c_ = r.get();
+    return true;
+  }
+  Replenish();
+  return true;
+}
+
+bool LuaMapTranslation::Next() {
+  if (exhausted()) {
+    return false;
+  }
+  started_ = true;
+  Replenish();
+  return !exhausted();
+}
+
+void LuaMapTranslation::Replenish() {
+  c_.reset();
+  while (!translation_->exhausted()) {
+    auto r = lua_->chain_call<an<Candidate>>(translation_->Peek(), stages_);
+    translation_->Next();
+    if (!r.ok()) {
+      LuaErr e = r.get_err();
+      LOG(ERROR) << "LuaMapTranslation error(" << e.status << "): " << e.e;
+      continue;
+    }
+    if ((c_ = r.get()))
+      return;
+  }
+  set_exhausted(true);
+}
+
+LuaMapTranslation::~LuaMapTranslation() {
+  lua_->gc();
+}
+
 static std::vector<std::string> split_string(const std::string& str, const std::string& delimiter) {
     std::vector<std::string> result;
     size_t pos = 0;
@@ -62,7 +141,9 @@ static bool sub_module_init(lua_State *L, const Ticket &t,
 }
 //---
 static void raw_init(lua_State *L, const Ticket &t,
-                     an<LuaObj> *env, an<LuaObj> *func, an<LuaObj> *fini, an<LuaObj> *tags_match= NULL) {
+                     an<LuaObj> *env, an<LuaObj> *func, an<LuaObj> *fini, an<LuaObj> *tags_match= NULL,
+                     an<LuaObj> *map= NULL, bool *tags_match_cacheable= NULL,
+                     std::function<void (lua_State *)> options= nullptr) {
   lua_newtable(L);
   Engine *e = t.engine;
   LuaType<Engine *>::pushdata(L, e);
@@ -124,10 +205,28 @@ static void raw_init(lua_State *L, const Ticket &t,
       lua_pop(L, 1);
     }
 
+    if (tags_match_cacheable) {
+      lua_getfield(L, -1, "tags_match_cacheable");
+      *tags_match_cacheable = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+
+    // component specific fields of the module table
+    if (options)
+      options(L);
+
+    if (map) {
+      lua_getfield(L, -1, "map");
+      if (lua_type(L, -1) == LUA_TFUNCTION) {
+        *map = LuaObj::todata(L, -1);
+      }
+      lua_pop(L, 1);
+    }
+
     lua_getfield(L, -1, "func");
   }
 
-  if (lua_type(L, -1) != LUA_TFUNCTION) {
+  if (lua_type(L, -1) != LUA_TFUNCTION && !(map && *map)) {
     LOG(ERROR) << "Lua Compoment of initialize  error:("
       << " module: "<< t.klass
       << " name_space: " << t.name_space
@@ -141,17 +240,30 @@ static void raw_init(lua_State *L, const Ticket &t,
 //--- LuaFilter
 LuaFilter::LuaFilter(const Ticket& ticket, Lua* lua)
   : Filter(ticket), TagMatching(ticket), lua_(lua) {
-  lua->to_state([&](lua_State *L) {raw_init(L, ticket, &env_, &func_, &fini_, &tags_match_);});
+  lua->to_state([&](lua_State *L) {raw_init(L, ticket, &env_, &func_, &fini_, &tags_match_,
+                                            &map_, &tags_match_cacheable_);});
+  if (tags_match_ && tags_match_cacheable_ && engine_) {
+    option_update_connection_ = engine_->context()->option_update_notifier()
+      .connect([this](Context *, const string &) { tags_match_cache_.clear(); });
+  }
 }
 
 an<Translation> LuaFilter::Apply(
   an<Translation> translation, CandidateList* candidates) {
+  if (map_) {
+    // streaming filter: join the previous Lua filter's pass if possible
+    auto fused = As<LuaMapTranslation>(translation);
+    if (fused && fused->Fuse(lua_, map_, env_))
+      return fused;
+    return New<LuaMapTranslation>(lua_, translation, map_, env_);
+  }
   auto f = lua_->newthread<an<LuaObj>, an<Translation>,
                            an<LuaObj>, CandidateList *>(func_, translation, env_, candidates);
   return New<LuaTranslation>(lua_, f);
 }
 
 LuaFilter::~LuaFilter() {
+  option_update_connection_.disconnect();
   if (fini_) {
     auto r = lua_->void_call<an<LuaObj>, an<LuaObj>>(fini_, env_);
     if (!r.ok()) {
@@ -162,13 +274,158 @@ LuaFilter::~LuaFilter() {
 }
 
 //--- LuaTranslator
+struct LuaTranslator::QueryRecord {
+  an<Translation> source;
+  CandidateList candidates;
+  string key;
+  std::chrono::steady_clock::time_point time;
+  // held by the translation returned for the query that made the record;
+  // the source's coroutine holds that query's segment, so it is not
+  // resumed once that translation is gone with its menu
+  weak<bool> owner;
+  bool complete = false;
+  // set once a candidate that Clone() cannot copy is fetched
+  bool uncacheable = false;
+
+  // pulls from the source until candidates[i] is available
+  bool Fetch(size_t i) {
+    if (source && owner.expired())
+      source.reset();
+    while (candidates.size() <= i && source && !source->exhausted()) {
+      candidates.push_back(source->Peek());
+      uncacheable = uncacheable || !Clonable(candidates.back());
+      source->Next();
+    }
+    if (source && source->exhausted()) {
+      source.reset();
+      complete = true;
+    }
+    return i < candidates.size();
+  }
+
+  bool Reusable() const {
+    return !uncacheable && (complete || !owner.expired());
+  }
+
+  // a Clone() of these keeps all of the candidate's data
+  static bool Clonable(const an<Candidate>& cand) {
+    const auto &type = typeid(*cand);
+    return type == typeid(Phrase) || type == typeid(SimpleCandidate);
+  }
+};
+
+namespace {
+
+// A copy of a candidate whose text or comment a filter can set, so that
+// replays do not see each other's changes. Other candidate types would be
+// sliced; queries that yield them are not replayed, and the translation
+// that made the record gets them as they are.
+an<Candidate> Clone(const an<Candidate>& cand) {
+  if (!LuaTranslator::QueryRecord::Clonable(cand))
+    return cand;
+  if (auto p = As<Phrase>(cand)) {
+    auto c = New<Phrase>(p->language(), p->type(), p->start(), p->end(),
+                         New<DictEntry>(p->entry()));
+    c->set_quality(p->quality());
+    return c;
+  }
+  return New<SimpleCandidate>(*As<SimpleCandidate>(cand));
+}
+
+class ReplayTranslation : public Translation {
+public:
+  ReplayTranslation(an<LuaTranslator::QueryRecord> record,
+                    an<bool> owner = nullptr)
+    : record_(record), owner_(owner) {
+    set_exhausted(!record_->Fetch(0));
+  }
+
+  bool Next() {
+    if (exhausted())
+      return false;
+    c_.reset();
+    set_exhausted(!record_->Fetch(++index_));
+    return !exhausted();
+  }
+
+  an<Candidate> Peek() {
+    if (exhausted())
+      return nullptr;
+    if (!c_)
+      c_ = Clone(record_->candidates[index_]);
+    return c_;
+  }
+
+private:
+  an<LuaTranslator::QueryRecord> record_;
+  an<bool> owner_;
+  size_t index_ = 0;
+  an<Candidate> c_;
+};
+
+}
+
 LuaTranslator::LuaTranslator(const Ticket& ticket, Lua* lua)
   : Translator(ticket), lua_(lua) {
-  lua->to_state([&](lua_State *L) {raw_init(L, ticket, &env_, &func_, &fini_);});
+  lua->to_state([&](lua_State *L) {
+    raw_init(L, ticket, &env_, &func_, &fini_, NULL, NULL, NULL, [&](lua_State *L) {
+      lua_getfield(L, -1, "query_cache_size");
+      if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0)
+        query_cache_.resize(lua_tointeger(L, -1));
+      lua_pop(L, 1);
+      lua_getfield(L, -1, "query_cache_ttl");
+      query_cache_ttl_ = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+      lua_pop(L, 1);
+      lua_getfield(L, -1, "query_cache_key");
+      if (lua_type(L, -1) == LUA_TFUNCTION)
+        query_cache_key_ = LuaObj::todata(L, -1);
+      lua_pop(L, 1);
+      lua_getfield(L, -1, "incremental");
+      incremental_ = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    });
+  });
+  // a replay may resume the coroutine of an older query, which would
+  // overwrite env.continuation behind continuation_input_
+  if (incremental_ && query_cache_.capacity() > 0) {
+    LOG(WARNING) << "LuaTranslator of " << name_space_
+                 << ": query_cache_size is ignored by incremental translators";
+    query_cache_.resize(0);
+  }
+  if (incremental_ && engine_) {
+    Context *ctx = engine_->context();
+    commit_connection_ = ctx->commit_notifier()
+      .connect([this](Context *) { DropContinuation(); });
+    update_connection_ = ctx->update_notifier()
+      .connect([this](Context *ctx) {
+        if (ctx->input().empty())
+          DropContinuation();
+      });
+  }
 }
 
-an<Translation> LuaTranslator::Query(const string& input,
-                                     const Segment& segment) {
+void LuaTranslator::DropContinuation() {
+  continuation_input_.clear();
+  lua_->to_state([&](lua_State *L) {
+    LuaObj::pushdata(L, env_);
+    lua_pushnil(L);
+    lua_setfield(L, -2, "continuation");
+    lua_pop(L, 1);
+  });
+}
+
+an<Translation> LuaTranslator::RawQuery(const string& input,
+                                        const Segment& segment) {
+  if (incremental_) {
+    // env.continuation is what the script left for a prefix of the input
+    bool extends = !continuation_input_.empty() &&
+      segment.start == continuation_start_ &&
+      input.compare(0, continuation_input_.size(), continuation_input_) == 0;
+    if (!extends)
+      DropContinuation();
+    continuation_input_ = input;
+    continuation_start_ = segment.start;
+  }
   auto f = lua_->newthread<an<LuaObj>, const string &, const Segment &,
                            an<LuaObj>>(func_, input, segment, env_);
   an<Translation> t = New<LuaTranslation>(lua_, f);
@@ -178,7 +435,56 @@ an<Translation> LuaTranslator::Query(const string& input,
     return t;
 }
 
+an<Translation> LuaTranslator::Query(const string& input,
+                                     const Segment& segment) {
+  if (query_cache_.capacity() == 0)
+    return RawQuery(input, segment);
+
+  // an explicit invalidation key: entries made under another key are stale
+  string key;
+  if (query_cache_key_) {
+    auto r = lua_->call<string, an<LuaObj>, an<LuaObj>>(query_cache_key_, env_);
+    if (!r.ok()) {
+      auto e = r.get_err();
+      LOG(ERROR) << "LuaTranslator::Query of " << name_space_ << " query_cache_key error(" << e.status << "): " << e.e;
+      return RawQuery(input, segment);
+    }
+    key = r.get();
+  }
+
+  std::ostringstream ostr;
+  ostr << input << '\t' << segment.start << ',' << segment.end;
+  for (const auto &tag : segment.tags)
+    ostr << ' ' << tag;
+  const string query = ostr.str();
+
+  auto now = std::chrono::steady_clock::now();
+  an<QueryRecord> record;
+  if (auto p = query_cache_.get(query)) {
+    if ((*p)->key == key && (*p)->Reusable() && (query_cache_ttl_ <= 0 ||
+          now - (*p)->time < std::chrono::milliseconds(query_cache_ttl_)))
+      record = *p;
+  }
+  if (record) {
+    an<Translation> t = New<ReplayTranslation>(record);
+    return t->exhausted() ? an<Translation>() : t;
+  }
+
+  auto owner = New<bool>(true);
+  record = New<QueryRecord>();
+  record->source = RawQuery(input, segment);
+  record->complete = !record->source;
+  record->key = key;
+  record->time = now;
+  record->owner = owner;
+  query_cache_.put(query, record);
+  an<Translation> t = New<ReplayTranslation>(record, owner);
+  return t->exhausted() ? an<Translation>() : t;
+}
+
 LuaTranslator::~LuaTranslator() {
+  commit_connection_.disconnect();
+  update_connection_.disconnect();
   if (fini_) {
     auto r = lua_->void_call<an<LuaObj>, an<LuaObj>>(fini_, env_);
     if (!r.ok()) {
@@ -222,6 +528,8 @@ LuaProcessor::LuaProcessor(const Ticket& ticket, Lua* lua)
 }
 
 ProcessResult LuaProcessor::ProcessKeyEvent(const KeyEvent& key_event) {
+  // coalesced notifications still pending from the last key
+  lua_->run_deferred();
   auto r = lua_->call<int, an<LuaObj>, const KeyEvent&,
                       an<LuaObj>>(func_, key_event, env_);
   if (!r.ok()) {
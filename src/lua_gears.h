@@ -8,6 +8,9 @@
 #include <rime/processor.h>
 #include <rime/gear/filter_commons.h>
 #include "lib/lua.h"
+#include "lru_cache.h"
+#include <map>
+#include <set>
 
 namespace rime {
 
@@ -30,6 +33,36 @@ private:
   Lua *lua_;
   an<Candidate> c_;
   an<LuaObj> f_;
+  // set when the generator returns a translation instead of yielding
+  an<Translation> t_;
+};
+
+// Runs the per-candidate `map` functions of adjacent Lua filters
+// back-to-back in a single pass over the translation.
+class LuaMapTranslation : public Translation {
+public:
+  LuaMapTranslation(Lua *lua, an<Translation> translation,
+                    an<LuaObj> map, an<LuaObj> env);
+
+  // Appends a stage; fails once candidates have been consumed.
+  bool Fuse(Lua *lua, an<LuaObj> map, an<LuaObj> env);
+
+  bool Next();
+
+  an<Candidate> Peek() {
+    return c_;
+  }
+
+  virtual ~LuaMapTranslation();
+
+private:
+  void Replenish();
+
+  Lua *lua_;
+  an<Translation> translation_;
+  Lua::Chain stages_;
+  an<Candidate> c_;
+  bool started_ = false;
 };
 
 class LuaFilter : public Filter, TagMatching {
@@ -44,14 +77,21 @@ public:
     if ( ! tags_match_ )
       return TagsMatch(segment);
 
+    if (tags_match_cacheable_) {
+      auto it = tags_match_cache_.find(segment->tags);
+      if (it != tags_match_cache_.end())
+        return it->second;
+    }
+
     auto r = lua_->call<bool, an<LuaObj>, Segment *, an<LuaObj>>(tags_match_, segment,  env_);
     if (!r.ok()) {
       auto e = r.get_err();
       LOG(ERROR) << "LuaFilter::AppliesToSegment of " << name_space_ << " error(" << e.status << "): " << e.e;
       return false;
     }
-    else
-      return  r.get();
+    if (tags_match_cacheable_)
+      tags_match_cache_[segment->tags] = r.get();
+    return  r.get();
   }
 
 private:
@@ -60,6 +100,11 @@ private:
   an<LuaObj> func_;
   an<LuaObj> fini_;
   an<LuaObj> tags_match_;
+  an<LuaObj> map_;
+  // tags_match declared as a pure function of segment tags and options
+  bool tags_match_cacheable_ = false;
+  std::map<std::set<string>, bool> tags_match_cache_;
+  connection option_update_connection_;
 };
 
 class LuaTranslator : public Translator {
@@ -70,11 +115,29 @@ public:
   virtual an<Translation> Query(const string& input,
                                 const Segment& segment);
 
+  // Candidates produced for a query, shared by the translations
+  // replaying it.
+  struct QueryRecord;
+
 private:
+  an<Translation> RawQuery(const string& input,
+                           const Segment& segment);
+  void DropContinuation();
+
   Lua *lua_;
   an<LuaObj> env_;
   an<LuaObj> func_;
   an<LuaObj> fini_;
+  // opt-in query cache, keyed by input, segment range and tags
+  an<LuaObj> query_cache_key_;
+  int query_cache_ttl_ = 0;
+  LruCache<string, an<QueryRecord>> query_cache_;
+  // opt-in env.continuation, kept while the input keeps growing
+  bool incremental_ = false;
+  string continuation_input_;
+  size_t continuation_start_ = 0;
+  connection commit_connection_;
+  connection update_connection_;
 };
 
 class LuaSegmentor : public Segmentor {
@@ -105,6 +168,14 @@ private:
   an<LuaObj> fini_;
 };
 
+// start loading OpenCC configs in the background (opencc.cc)
+void opencc_preload(const vector<string> &filenames);
+// the configs listed under lua/opencc_preload of the schema
+void opencc_preload(const Ticket &ticket);
+void opencc_preload_stop();
+// drops dictionaries idle past rime_api.set_dict_cache_idle() (types.cc)
+void dict_cache_sweep();
+
 template<typename T>
 
 class LuaComponent : public T::Component {
@@ -114,6 +185,8 @@ private:
 public:
   LuaComponent(an<Lua> lua) : lua_(lua) {};
   T* Create(const Ticket &a) {
+    opencc_preload(a);
+    dict_cache_sweep();
     Ticket t(a.engine, a.name_space, a.name_space);
     return new T(t, lua_.get());
   }
@@ -5,6 +5,7 @@
 #include <rime/service.h>
 #include "lib/lua_templates.h"
 #include "lua_gears.h"
+#include "async_db.h"
 
 void types_init(lua_State *L);
 
@@ -88,6 +89,20 @@ static void lua_init(lua_State *L) {
                  "rime user data directory or in the rime shared "
                  "data directory";
   }
+
+  // opencc_preload = { "s2t.json", ... } in rime.lua
+  lua_getglobal(L, "opencc_preload");
+  if (lua_istable(L, -1)) {
+    std::vector<std::string> filenames;
+    for (int i = 1; i <= (int) lua_rawlen(L, -1); i++) {
+      lua_rawgeti(L, -1, i);
+      if (lua_type(L, -1) == LUA_TSTRING)
+        filenames.push_back(lua_tostring(L, -1));
+      lua_pop(L, 1);
+    }
+    rime::opencc_preload(filenames);
+  }
+  lua_pop(L, 1);
 }
 
 static void rime_lua_initialize() {
@@ -106,6 +121,9 @@ static void rime_lua_initialize() {
 }
 
 static void rime_lua_finalize() {
+  rime::opencc_preload_stop();
+  rime::AsyncDb::FlushAll();
+  rime::dict_cache_sweep();
 }
 
 RIME_REGISTER_MODULE(lua)
@@ -13,11 +13,25 @@
 #include <opencc/Dict.hpp>
 #include <opencc/DictEntry.hpp>
 #include <opencc/Common.hpp>
+#include <opencc/Lexicon.hpp>
+#include <rime/candidate.h>
 #include <rime/common.h>
+#include <rime/config.h>
+#include <rime/schema.h>
 #include <rime/service.h>
+#include <rime/ticket.h>
+#include <rime/translation.h>
+#include <algorithm>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include "lib/lua_export_type.h"
 #include "optional.h"
+#include "lru_cache.h"
+#include "shared_cache.h"
 
 using std::string;
 using std::vector;
@@ -26,10 +40,58 @@ using namespace rime;
 
 namespace {
 
+// A converter shared by every Opencc of the same config file.
+struct SharedConverter {
+  opencc::ConverterPtr converter;
+  std::time_t mtime;
+  mutable size_t memory = 0;
+
+  // approximate bytes of the dictionaries in the chain
+  size_t Memory() const;
+};
+
+size_t SharedConverter::Memory() const {
+  if (memory == 0) {
+    for (const auto& conversion :
+         converter->GetConversionChain()->GetConversions()) {
+      auto dict = conversion->GetDict();
+      if (!dict)
+        continue;
+      for (const auto& entry : *dict->GetLexicon()) {
+        memory += entry->KeyLength() + sizeof(*entry);
+        for (const auto& value : entry->Values())
+          memory += value.size() + sizeof(value);
+      }
+    }
+  }
+  return memory;
+}
+
+// Results of convert_text and convert_word, unchanged ones included.
+struct ConversionCache {
+  struct Text {
+    bool changed;
+    string value;  // empty if unchanged
+  };
+  struct Word {
+    bool found;
+    vector<string> forms;
+  };
+
+  explicit ConversionCache(size_t capacity)
+    : texts(capacity), words(capacity) {}
+
+  LruCache<string, Text> texts;
+  LruCache<string, Word> words;
+};
+
 class Opencc {
 public:
   //static shared_ptr<Opencc> create(const path &config_path);
   Opencc(const string& utf8_config_path);
+  // the shared converter of a config file, loaded again if the file changed;
+  // throws if the file is missing or invalid
+  static an<const SharedConverter> Load(const string& utf8_config_path);
   bool ConvertWord(const string& text, vector<string>* forms);
   bool RandomConvertText(const string& text, string* simplified);
   bool ConvertText(const string& text, string* simplified);
@@ -38,108 +100,209 @@ public:
   string random_convert_text( const string& text);
   string convert_text( const string& text);
 
+  // caches the results of the last `capacity` texts and words converted;
+  // shared by copies of this object
+  void SetCacheSize(size_t capacity);
+  size_t cache_hits() const;
+  size_t cache_misses() const;
+
 private:
+  bool DoConvertWord(const string& text, vector<string>* forms);
+  bool DoConvertText(const string& text, string* simplified);
+
+  an<const SharedConverter> shared_;
+  an<ConversionCache> cache_;
   opencc::ConverterPtr converter_;
   opencc::DictPtr dict_;
+  // dicts of the conversion chain, empty if one is missing
+  vector<opencc::DictPtr> dicts_;
+  // scratch space of ConvertWord and RandomConvertText
+  vector<string> words_;
+  vector<string> next_words_;
+  string buffers_[2];
 };
 
-Opencc::Opencc(const string& utf8_config_path) {
-  opencc::Config config;
-  // OpenCC accepts UTF-8 encoded path.
-  converter_ = config.NewFromFile(utf8_config_path);
+an<const SharedConverter> Opencc::Load(const string& utf8_config_path) {
+  // 0 if the file cannot be stat'ed: OpenCC still tries it, and the
+  // converter is then kept until evicted
+  std::time_t mtime = file_mtime(utf8_config_path);
+  return SharedCache<const SharedConverter>::instance().get(
+      utf8_config_path,
+      [&]() {
+        opencc::Config config;
+        // OpenCC accepts UTF-8 encoded path.
+        return New<const SharedConverter>(
+            SharedConverter{config.NewFromFile(utf8_config_path), mtime});
+      },
+      [mtime](const SharedConverter& c) { return c.mtime == mtime; });
+}
+
+Opencc::Opencc(const string& utf8_config_path)
+  : shared_(Load(utf8_config_path)), converter_(shared_->converter) {
   const list<opencc::ConversionPtr> conversions =
     converter_->GetConversionChain()->GetConversions();
   dict_ = conversions.front()->GetDict();
+  for (const auto& conversion : conversions) {
+    opencc::DictPtr dict = conversion->GetDict();
+    if (dict == nullptr) {
+      dicts_.clear();
+      break;
+    }
+    dicts_.push_back(dict);
+  }
+}
+
+void Opencc::SetCacheSize(size_t capacity) {
+  cache_ = capacity ? New<ConversionCache>(capacity) : nullptr;
+}
+
+size_t Opencc::cache_hits() const {
+  return cache_ ? cache_->texts.hits() + cache_->words.hits() : 0;
+}
+
+size_t Opencc::cache_misses() const {
+  return cache_ ? cache_->texts.misses() + cache_->words.misses() : 0;
 }
 
 bool Opencc::ConvertText(const string& text, string* simplified) {
+  if (!cache_)
+    return DoConvertText(text, simplified);
+  if (auto hit = cache_->texts.get(text)) {
+    *simplified = hit->changed ? hit->value : text;
+    return hit->changed;
+  }
+  bool changed = DoConvertText(text, simplified);
+  cache_->texts.put(text, {changed, changed ? *simplified : string()});
+  return changed;
+}
+
+bool Opencc::ConvertWord(const string& text, vector<string>* forms) {
+  if (!cache_)
+    return DoConvertWord(text, forms);
+  if (auto hit = cache_->words.get(text)) {
+    if (hit->found)
+      *forms = hit->forms;
+    return hit->found;
+  }
+  bool found = DoConvertWord(text, forms);
+  cache_->words.put(text, {found, found ? *forms : vector<string>()});
+  return found;
+}
+
+bool Opencc::DoConvertText(const string& text, string* simplified) {
   if (converter_ == nullptr) return false;
   *simplified = converter_->Convert(text);
   return *simplified != text;
 }
 
-bool Opencc::ConvertWord(const string& text, vector<string>* forms) {
-  if (converter_ == nullptr) return false;
-  const list<opencc::ConversionPtr> conversions =
-        converter_->GetConversionChain()->GetConversions();
-  vector<string> original_words{text};
+// Appends the conversion of text by dict, each longest prefix match
+// replaced by its default value, to *out.
+static void ConvertByPrefix(const opencc::Dict& dict, const string& text,
+                            string* out) {
+  for (const char* wstr = text.c_str(); *wstr != '\0';) {
+    opencc::Optional<const opencc::DictEntry*> matched =
+        dict.MatchPrefix(wstr);
+    size_t matched_length;
+    if (matched.IsNull()) {
+      matched_length = opencc::UTF8Util::NextCharLength(wstr);
+      out->append(wstr, matched_length);
+    } else {
+      matched_length = matched.Get()->KeyLength();
+      out->append(matched.Get()->GetDefault());
+    }
+    wstr += matched_length;
+  }
+}
+
+// Takes the next unused slot of words, for its capacity.
+static string& NextSlot(vector<string>& words, size_t count) {
+  if (count == words.size())
+    words.emplace_back();
+  words[count].clear();
+  return words[count];
+}
+
+// Whether the word in slot `count` is among the first `count` words.
+static bool IsDuplicate(const vector<string>& words, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (words[i] == words[count])
+      return true;
+  }
+  return false;
+}
+
+bool Opencc::DoConvertWord(const string& text, vector<string>* forms) {
+  if (converter_ == nullptr || dicts_.empty()) return false;
+  // words_[0, count) are the forms so far, next_words_ receives the next
+  // ones; both keep their strings between calls
+  size_t count = 1;
+  NextSlot(words_, 0).assign(text);
   bool matched = false;
-  for (auto conversion : conversions) {
-    opencc::DictPtr dict = conversion->GetDict();
-    if (dict == nullptr) return false;
-    set<string> word_set;
-    vector<string> converted_words;
-    for (const auto& original_word : original_words) {
+  for (const auto& dict : dicts_) {
+    size_t next_count = 0;
+    for (size_t i = 0; i < count; i++) {
+      const string& original_word = words_[i];
       opencc::Optional<const opencc::DictEntry*> item =
           dict->Match(original_word);
       if (item.IsNull()) {
         // No exact match, but still need to convert partially matched
-        std::ostringstream buffer;
-        for (const char* wstr = original_word.c_str(); *wstr != '\0';) {
-          opencc::Optional<const opencc::DictEntry*> matched =
-              dict->MatchPrefix(wstr);
-          size_t matched_length;
-          if (matched.IsNull()) {
-            matched_length = opencc::UTF8Util::NextCharLength(wstr);
-            buffer << opencc::UTF8Util::FromSubstr(wstr, matched_length);
-          } else {
-            matched_length = matched.Get()->KeyLength();
-            buffer << matched.Get()->GetDefault();
-          }
-          wstr += matched_length;
-        }
-        const string& converted_word = buffer.str();
         // Even if current dictionary doesn't convert the word
         // (converted_word == original_word), we still need to keep it for
         // subsequent dicts in the chain. e.g. s2t.json expands 里 to 里 and
         // 裏, then t2tw.json passes 里 as-is and converts 裏 to 裡.
-        if (word_set.insert(converted_word).second) {
-          converted_words.push_back(converted_word);
-        }
+        ConvertByPrefix(*dict, original_word,
+                        &NextSlot(next_words_, next_count));
+        if (!IsDuplicate(next_words_, next_count))
+          ++next_count;
         continue;
       }
       matched = true;
       const opencc::DictEntry* entry = item.Get();
       for (const auto& converted_word : entry->Values()) {
-        if (word_set.insert(converted_word).second) {
-          converted_words.push_back(converted_word);
-        }
+        NextSlot(next_words_, next_count).assign(converted_word);
+        if (!IsDuplicate(next_words_, next_count))
+          ++next_count;
       }
     }
-    original_words.swap(converted_words);
+    words_.swap(next_words_);
+    count = next_count;
   }
   // No dictionary contains the word
   if (!matched) return false;
-  *forms = std::move(original_words);
+  forms->assign(words_.begin(), words_.begin() + count);
   return forms->size() > 0;
 }
 
 bool Opencc::RandomConvertText(const string& text, string* simplified) {
-  if (dict_ == nullptr) return false;
-  const list<opencc::ConversionPtr> conversions =
-        converter_->GetConversionChain()->GetConversions();
-  const char* phrase = text.c_str();
-  for (auto conversion : conversions) {
-    opencc::DictPtr dict = conversion->GetDict();
-    if (dict == nullptr) return false;
-    std::ostringstream buffer;
-    for (const char* pstr = phrase; *pstr != '\0';) {
+  if (dict_ == nullptr || dicts_.empty()) return false;
+  // converts from *input to *output, alternating between the buffers
+  const string* input = &text;
+  string* output = &buffers_[0];
+  for (const auto& dict : dicts_) {
+    output->clear();
+    output->reserve(input->size());
+    for (const char* pstr = input->c_str(); *pstr != '\0';) {
       opencc::Optional<const opencc::DictEntry*> matched =
           dict->MatchPrefix(pstr);
       size_t matched_length;
       if (matched.IsNull()) {
         matched_length = opencc::UTF8Util::NextCharLength(pstr);
-        buffer << opencc::UTF8Util::FromSubstr(pstr, matched_length);
+        output->append(pstr, matched_length);
       } else {
-        matched_length = matched.Get()->KeyLength();
-        size_t i = rand() % (matched.Get()->NumValues());
-        buffer << matched.Get()->Values().at(i);
+        const opencc::DictEntry* entry = matched.Get();
+        matched_length = entry->KeyLength();
+        size_t n = entry->NumValues();
+        if (n <= 1)
+          output->append(entry->GetDefault());
+        else
+          output->append(entry->Values().at(rand() % n));
       }
       pstr += matched_length;
     }
-    *simplified = buffer.str();
-    phrase = simplified->c_str();
+    input = output;
+    output = output == &buffers_[0] ? &buffers_[1] : &buffers_[0];
   }
+  *simplified = *input;
   return *simplified != text;
 }
 
@@ -169,46 +332,47 @@ namespace OpenccReg {
 
   template<typename U, typename = void>
   struct COMPAT {
-    static optional<T> make(const string &filename) {
+    // config paths of filename, the user one first
+    static vector<string> paths(const string &filename) {
       auto user_path = string(rime_get_api()->get_user_data_dir());
       auto shared_path = string(rime_get_api()->get_shared_data_dir());
-      try{
-        return T(user_path + "/opencc/" + filename);
-      }
-      catch(...) {
-        try{
-          return T(shared_path + "/opencc/" + filename);
-        }
-        catch(...) {
-          LOG(ERROR) << " [" << user_path << "|" << shared_path << "]/opencc/"
-                     << filename  << ": File not found or InvalidFormat";
-          return {};
-        }
-      }
+      return {user_path + "/opencc/" + filename,
+              shared_path + "/opencc/" + filename};
     }
   };
 
   template<typename U>
   struct COMPAT<U, void_t<decltype(std::declval<U>().user_data_dir.string())>> {
-    static optional<T> make(const string &filename) {
+    static vector<string> paths(const string &filename) {
       U &deployer = Service::instance().deployer();
       auto user_path = deployer.user_data_dir;
       auto shared_path = deployer.shared_data_dir;
-      try{
-        return T((user_path / "opencc" / filename).u8string());
+      return {(user_path / "opencc" / filename).u8string(),
+              (shared_path / "opencc" / filename).u8string()};
+    }
+  };
+
+  optional<T> load(const string &filename) {
+    auto paths = COMPAT<Deployer>::paths(filename);
+    for (const auto &path : paths) {
+      try {
+        return T(path);
       }
       catch(...) {
-        try{
-          return T((shared_path / "opencc" / filename).u8string());
-        }
-        catch(...) {
-          LOG(ERROR) << " [" << user_path << "|" << shared_path << "]/opencc/"
-                     << filename  << ": File not found or InvalidFormat";
-          return {};
-        }
       }
     }
-  };
+    LOG(ERROR) << " [" << paths.front() << "|" << paths.back()
+               << "]: File not found or InvalidFormat";
+    return {};
+  }
+
+  // Opencc(filename[, cache_size])
+  optional<T> make(const string &filename, optional<int> cache_size) {
+    auto t = load(filename);
+    if (t && cache_size && *cache_size > 0)
+      t->SetCacheSize(*cache_size);
+    return t;
+  }
 
   optional<vector<string>> convert_word(T &t,const string &s) {
     vector<string> res;
@@ -217,8 +381,58 @@ namespace OpenccReg {
     return {};
   }
 
+  // texts converted by convert_text, in the same order
+  vector<string> convert_many(T &t, const vector<string> &texts) {
+    vector<string> res(texts.size());
+    for (size_t i = 0; i < texts.size(); i++) {
+      if (!t.ConvertText(texts[i], &res[i]))
+        res[i] = texts[i];
+    }
+    return res;
+  }
+
+  // Candidates of a translation with their text converted.
+  // Unchanged candidates are passed as they are.
+  class ConvertTranslation : public Translation {
+  public:
+    ConvertTranslation(an<Translation> translation, const T &opencc)
+      : translation_(translation), opencc_(opencc) {
+      set_exhausted(translation_->exhausted());
+    }
+
+    bool Next() {
+      if (exhausted())
+        return false;
+      translation_->Next();
+      c_.reset();
+      set_exhausted(translation_->exhausted());
+      return !exhausted();
+    }
+
+    an<Candidate> Peek() {
+      if (exhausted())
+        return nullptr;
+      if (!c_) {
+        c_ = translation_->Peek();
+        if (c_ && opencc_.ConvertText(c_->text(), &buffer_))
+          c_ = New<ShadowCandidate>(c_, c_->type(), buffer_);
+      }
+      return c_;
+    }
+
+  private:
+    an<Translation> translation_;
+    T opencc_;
+    an<Candidate> c_;
+    string buffer_;
+  };
+
+  an<Translation> convert_translation(T &t, an<Translation> translation) {
+    return New<ConvertTranslation>(translation, t);
+  }
+
   static const luaL_Reg funcs[] = {
-    {"Opencc",WRAP(COMPAT<Deployer>::make)},
+    {"Opencc",WRAP(make)},
     { NULL, NULL },
   };
 
@@ -227,10 +441,14 @@ namespace OpenccReg {
     {"random_convert_text", WRAPMEM(T,random_convert_text)},
     {"convert_text", WRAPMEM(T,convert_text)},
     {"convert", WRAPMEM(T,convert_text)},
+    {"convert_many", WRAP(convert_many)},
+    {"convert_translation", WRAP(convert_translation)},
     { NULL, NULL },
   };
 
   static const luaL_Reg vars_get[] = {
+    {"cache_hits", WRAPMEM(T, cache_hits)},
+    {"cache_misses", WRAPMEM(T, cache_misses)},
     { NULL, NULL },
   };
 
@@ -241,6 +459,148 @@ namespace OpenccReg {
 
 }
 
+namespace {
+
+// rime_api.opencc_usage() return { { key, refs, size, idle }, ... }
+// of the shared converters, by config path
+int raw_opencc_usage(lua_State *L) {
+  auto usage = SharedCache<const SharedConverter>::instance().usage(
+      [](const SharedConverter& c) { return c.Memory(); });
+  lua_createtable(L, (int) usage.size(), 0);
+  for (size_t i = 0; i < usage.size(); i++) {
+    const auto& u = usage[i];
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, u.key.c_str());
+    lua_setfield(L, -2, "key");
+    lua_pushinteger(L, u.refs);
+    lua_setfield(L, -2, "refs");
+    lua_pushinteger(L, (lua_Integer) u.size);
+    lua_setfield(L, -2, "size");
+    lua_pushnumber(L, u.idle);
+    lua_setfield(L, -2, "idle");
+    lua_rawseti(L, -2, (lua_Integer) i + 1);
+  }
+  return 1;
+}
+
+// Loads converters into the shared cache on a worker thread, ahead of
+// their first use. A preloaded converter no script takes is dropped
+// after the idle timeout of the cache like any other.
+class Preloader {
+public:
+  static Preloader& instance() {
+    static Preloader preloader;
+    return preloader;
+  }
+
+  ~Preloader() { Stop(); }
+
+  // paths: candidate paths of a config, the first loadable one is used
+  void Add(vector<string> paths) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (std::find(queue_.begin(), queue_.end(), paths) != queue_.end())
+        return;
+      queue_.push_back(std::move(paths));
+      if (!worker_.joinable()) {
+        stop_ = false;
+        worker_ = std::thread(&Preloader::Run, this);
+      }
+    }
+    cv_.notify_one();
+  }
+
+  // drops the queue and waits for the config being loaded
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      queue_.clear();
+    }
+    cv_.notify_all();
+    if (worker_.joinable())
+      worker_.join();
+  }
+
+private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (stop_)
+        return;
+      // stays queued while loading so that it is not added again
+      const vector<string> paths = queue_.front();
+      lock.unlock();
+      Load(paths);
+      lock.lock();
+      if (!queue_.empty() && queue_.front() == paths)
+        queue_.pop_front();
+    }
+  }
+
+  static void Load(const vector<string>& paths) {
+    for (const auto& path : paths) {
+      try {
+        Opencc::Load(path);
+        return;
+      }
+      catch (...) {
+      }
+    }
+    LOG(WARNING) << "opencc preload: cannot load " << paths.back();
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<vector<string>> queue_;
+  bool stop_ = false;
+  std::thread worker_;
+};
+
+}
+
+namespace rime {
+
+// schemas list their configs for every Lua component they create,
+// and most are loaded by then
+void opencc_preload(const vector<string> &filenames) {
+  auto &cache = SharedCache<const SharedConverter>::instance();
+  for (const auto &filename : filenames) {
+    auto paths = OpenccReg::COMPAT<Deployer>::paths(filename);
+    if (std::none_of(paths.begin(), paths.end(),
+                     [&](const string &path) { return cache.contains(path); }))
+      Preloader::instance().Add(std::move(paths));
+  }
+}
+
+void opencc_preload(const Ticket &ticket) {
+  if (!ticket.schema)
+    return;
+  auto list = ticket.schema->config()->GetList("lua/opencc_preload");
+  if (!list)
+    return;
+  vector<string> filenames;
+  for (size_t i = 0; i < list->size(); i++) {
+    auto value = list->GetValueAt(i);
+    if (value && !value->str().empty())
+      filenames.push_back(value->str());
+  }
+  opencc_preload(filenames);
+}
+
+void opencc_preload_stop() {
+  Preloader::instance().Stop();
+}
+
+}
+
 void LUAWRAPPER_LOCAL opencc_init(lua_State *L) {
   EXPORT_TYPE(OpenccReg, L);
+  lua_getglobal(L, "rime_api");
+  if (lua_istable(L, -1)) {
+    lua_pushcfunction(L, raw_opencc_usage);
+    lua_setfield(L, -2, "opencc_usage");
+  }
+  lua_pop(L, 1);
 }
@@ -0,0 +1,84 @@
+#ifndef PROXY_DB_H
+#define PROXY_DB_H
+
+#include <rime/common.h>
+#include <rime/dict/db.h>
+#include "db_compat.h"
+
+namespace rime {
+
+// A Db passing every call to another Db, for wrappers to override.
+// Transactions are passed on if the other Db has them.
+class ProxyDb : public Db, public Transactional {
+ public:
+  explicit ProxyDb(an<Db> db)
+      : Db(DbPath<Db>::of(*db), db->name()), db_(db) {
+    Sync(true);
+  }
+
+  virtual bool Open() { return Sync(db_->Open()); }
+  virtual bool OpenReadOnly() { return Sync(db_->OpenReadOnly()); }
+  virtual bool Close() { return Sync(db_->Close()); }
+
+  virtual bool Backup(const db_path &snapshot_file) {
+    return db_->Backup(snapshot_file);
+  }
+  virtual bool Restore(const db_path &snapshot_file) {
+    return db_->Restore(snapshot_file);
+  }
+
+  virtual bool CreateMetadata() { return db_->CreateMetadata(); }
+  virtual bool MetaFetch(const string &key, string *value) {
+    return db_->MetaFetch(key, value);
+  }
+  virtual bool MetaUpdate(const string &key, const string &value) {
+    return db_->MetaUpdate(key, value);
+  }
+
+  virtual an<DbAccessor> QueryMetadata() { return db_->QueryMetadata(); }
+  virtual an<DbAccessor> QueryAll() { return db_->QueryAll(); }
+  virtual an<DbAccessor> Query(const string &key) { return db_->Query(key); }
+  virtual bool Fetch(const string &key, string *value) {
+    return db_->Fetch(key, value);
+  }
+  virtual bool Update(const string &key, const string &value) {
+    return db_->Update(key, value);
+  }
+  virtual bool Erase(const string &key) { return db_->Erase(key); }
+
+  virtual bool BeginTransaction() {
+    auto tx = dynamic_cast<Transactional *>(db_.get());
+    if (!tx || !tx->BeginTransaction())
+      return false;
+    transaction_ = true;
+    return true;
+  }
+  virtual bool AbortTransaction() {
+    if (!in_transaction())
+      return false;
+    transaction_ = false;
+    return dynamic_cast<Transactional *>(db_.get())->AbortTransaction();
+  }
+  virtual bool CommitTransaction() {
+    if (!in_transaction())
+      return false;
+    transaction_ = false;
+    return dynamic_cast<Transactional *>(db_.get())->CommitTransaction();
+  }
+
+  an<Db> db() const { return db_; }
+
+ protected:
+  // copies the state of db_ after opening or closing it
+  bool Sync(bool ok) {
+    loaded_ = db_->loaded();
+    readonly_ = db_->readonly();
+    return ok;
+  }
+
+  an<Db> db_;
+};
+
+}  // namespace rime
+
+#endif /* PROXY_DB_H */
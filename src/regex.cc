@@ -0,0 +1,490 @@
+// boost::regex api
+
+#include <boost/regex.hpp>
+#include <rime/common.h>
+
+#include <algorithm>
+
+#include "lib/lua_export_type.h"
+#include "optional.h"
+#include "aho_corasick.h"
+#include "lru_cache.h"
+
+using std::string;
+using std::vector;
+using namespace rime;
+
+namespace {
+
+// patterns compiled for the string-pattern functions of rime_api
+const size_t kRegexCacheSize = 64;
+
+// valid until the next call
+boost::regex &cached_regex(const string &pattern) {
+  static LruCache<string, boost::regex> cache(kRegexCacheSize);
+  if (auto re = cache.get(pattern))
+    return *re;
+  return *cache.put(pattern, boost::regex(pattern));
+}
+
+// the length of the UTF-8 character at text[i], at least 1
+size_t char_length(const char *text, size_t len, size_t i) {
+  size_t n = 1;
+  while (i + n < len && (text[i + n] & 0xC0) == 0x80)
+    n++;
+  return n;
+}
+
+// flags: "i" ignore case, "x" ignore whitespace and comments,
+// "s" dot matches newline; logs and returns nil if invalid
+optional<boost::regex> compile(const string &pattern, const string &flags) {
+  boost::regex::flag_type f = boost::regex::perl;
+  for (char c : flags) {
+    switch (c) {
+      case 'i': f |= boost::regex::icase; break;
+      case 'x': f |= boost::regex::mod_x; break;
+      case 's': f |= boost::regex::mod_s; break;
+      default:
+        LOG(ERROR) << "regex " << pattern << ": unknown flag " << c;
+        return {};
+    }
+  }
+  try {
+    return boost::regex(pattern, f);
+  }
+  catch (const boost::regex_error &e) {
+    LOG(ERROR) << "regex " << pattern << ": " << e.what();
+    return {};
+  }
+}
+
+// Literals and regexes searched for together in a text.
+// Literals are found in one pass by an Aho-Corasick automaton.
+// Regexes without groups are tried first as one alternation, so that a
+// text matching none of them is scanned once.
+class PatternSet {
+ public:
+  void AddLiteral(const string &literal) {
+    literals_.insert(literal, (int) size_++);
+    built_ = false;
+  }
+
+  void AddRegex(const boost::regex &re) {
+    regexes_.push_back({re, (int) size_++});
+    built_ = false;
+  }
+
+  // indices of the patterns found in [begin, end), ascending
+  void Match(const char *begin, const char *end, vector<int> *indices);
+  bool Any(const string &text);
+  size_t size() const { return size_; }
+
+ private:
+  struct Regex {
+    boost::regex re;
+    int index;
+  };
+
+  void Build();
+  // whether to try each regex without groups
+  bool MaySearch(const char *begin, const char *end);
+
+  size_t size_ = 0;
+  AhoCorasick literals_;
+  vector<Regex> regexes_;
+  // alternation of regexes_ without groups, if any
+  optional<boost::regex> combined_;
+  bool built_ = false;
+  vector<char> seen_;
+};
+
+void PatternSet::Build() {
+  if (built_)
+    return;
+  literals_.build();
+  string alternation;
+  for (const auto &r : regexes_) {
+    // groups would renumber back references
+    if (r.re.mark_count() > 0)
+      continue;
+    auto f = r.re.flags();
+    string modifiers;
+    if (f & boost::regex::icase) modifiers += 'i';
+    if (f & boost::regex::mod_x) modifiers += 'x';
+    if (f & boost::regex::mod_s) modifiers += 's';
+    if (!alternation.empty())
+      alternation += '|';
+    // a newline ends an "x" mode comment
+    alternation += "(?" + modifiers + ":" + r.re.str() +
+                   (f & boost::regex::mod_x ? "\n)" : ")");
+  }
+  combined_.reset();
+  if (!alternation.empty()) {
+    try {
+      combined_ = boost::regex(alternation);
+    }
+    catch (const boost::regex_error &) {
+    }
+  }
+  seen_.assign(size_, 0);
+  built_ = true;
+}
+
+bool PatternSet::MaySearch(const char *begin, const char *end) {
+  return !combined_ || boost::regex_search(begin, end, *combined_);
+}
+
+void PatternSet::Match(const char *begin, const char *end,
+                       vector<int> *indices) {
+  Build();
+  indices->clear();
+  literals_.search(begin, end, [&](int id) {
+    if (!seen_[id]) {
+      seen_[id] = 1;
+      indices->push_back(id);
+    }
+    return true;
+  });
+  bool may_search = MaySearch(begin, end);
+  for (const auto &r : regexes_) {
+    if ((r.re.mark_count() > 0 || may_search) &&
+        boost::regex_search(begin, end, r.re))
+      indices->push_back(r.index);
+  }
+  for (int id : *indices)
+    seen_[id] = 0;
+  std::sort(indices->begin(), indices->end());
+}
+
+bool PatternSet::Any(const string &text) {
+  Build();
+  const char *begin = text.data(), *end = begin + text.size();
+  bool found = false;
+  literals_.search(begin, end, [&](int) {
+    found = true;
+    return false;
+  });
+  if (found)
+    return true;
+  bool may_search = MaySearch(begin, end);
+  for (const auto &r : regexes_) {
+    if ((r.re.mark_count() > 0 || may_search) &&
+        boost::regex_search(begin, end, r.re))
+      return true;
+  }
+  return false;
+}
+
+// match results reused by every search, so that their storage is
+// allocated once
+boost::cmatch &last_match() {
+  static boost::cmatch m;
+  return m;
+}
+
+// searches text from the 1-based offset init, negative counting from
+// the end, as string.find
+bool search_from(const boost::regex &re, const char *text, size_t len,
+                 lua_Integer init, boost::cmatch *m) {
+  if (init < 0)
+    init = std::max<lua_Integer>((lua_Integer) len + init + 1, 1);
+  else if (init == 0)
+    init = 1;
+  if ((size_t) init > len + 1)
+    return false;
+  size_t pos = (size_t) init - 1;
+  auto flags = pos > 0 ? boost::match_prev_avail : boost::match_default;
+  return boost::regex_search(text + pos, text + len, *m, re, flags);
+}
+
+// { match, capture1, ... }, "" for captures not matched
+void push_submatches(lua_State *L, const boost::cmatch &m) {
+  lua_createtable(L, (int) m.size(), 0);
+  for (int i = 0; i < (int) m.size(); i++) {
+    if (m[i].matched)
+      lua_pushlstring(L, m[i].first, m[i].length());
+    else
+      lua_pushliteral(L, "");
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+namespace RegexReg {
+  using T = boost::regex;
+
+  // rime_api.regex(pattern[, flags])
+  optional<T> make(const string &pattern, optional<string> flags) {
+    return compile(pattern, flags ? *flags : string());
+  }
+
+  // re:match(text) whether the whole text matches
+  int raw_match(lua_State *L) {
+    auto &re = LuaType<T>::todata(L, 1);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    lua_pushboolean(L, boost::regex_match(text, text + len, re));
+    return 1;
+  }
+
+  // re:search(text[, init]) return { match, capture1, ... } or nil
+  int raw_search(lua_State *L) {
+    auto &re = LuaType<T>::todata(L, 1);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    auto &m = last_match();
+    if (!search_from(re, text, len, luaL_optinteger(L, 3, 1), &m))
+      return 0;
+    push_submatches(L, m);
+    return 1;
+  }
+
+  // re:find(text[, init]) return the 1-based start and end of the match,
+  // or nil, as string.find
+  int raw_find(lua_State *L) {
+    auto &re = LuaType<T>::todata(L, 1);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    auto &m = last_match();
+    if (!search_from(re, text, len, luaL_optinteger(L, 3, 1), &m))
+      return 0;
+    lua_pushinteger(L, (lua_Integer) (m[0].first - text) + 1);
+    lua_pushinteger(L, (lua_Integer) (m[0].second - text));
+    return 2;
+  }
+
+  // re:capture(text, i[, init]) return capture i of the match,
+  // 0 for the whole match; nil if there is no match or no such capture
+  int raw_capture(lua_State *L) {
+    auto &re = LuaType<T>::todata(L, 1);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    lua_Integer i = luaL_checkinteger(L, 3);
+    auto &m = last_match();
+    if (!search_from(re, text, len, luaL_optinteger(L, 4, 1), &m) ||
+        i < 0 || i >= (lua_Integer) m.size() || !m[(int) i].matched)
+      return 0;
+    lua_pushlstring(L, m[(int) i].first, m[(int) i].length());
+    return 1;
+  }
+
+  string replace(T &re, const string &target, const string &fmt) {
+    return boost::regex_replace(target, re, fmt);
+  }
+
+  // upvalues: regex, text, offset of the next search
+  int raw_gmatch_step(lua_State *L) {
+    auto &re = LuaType<T>::todata(L, lua_upvalueindex(1));
+    size_t len;
+    const char *text = lua_tolstring(L, lua_upvalueindex(2), &len);
+    size_t pos = (size_t) lua_tointeger(L, lua_upvalueindex(3));
+    if (pos > len)
+      return 0;
+    auto &m = last_match();
+    auto flags = pos > 0 ? boost::match_prev_avail : boost::match_default;
+    if (!boost::regex_search(text + pos, text + len, m, re, flags)) {
+      lua_pushinteger(L, (lua_Integer) len + 1);
+      lua_replace(L, lua_upvalueindex(3));
+      return 0;
+    }
+    size_t end = m[0].second - text;
+    // step over an empty match
+    if (m[0].first == m[0].second)
+      end += char_length(text, len, end);
+    lua_pushinteger(L, (lua_Integer) end);
+    lua_replace(L, lua_upvalueindex(3));
+    // the captures, or the whole match if there is none
+    int n = m.size() > 1 ? (int) m.size() - 1 : 1;
+    luaL_checkstack(L, n, NULL);
+    for (int i = m.size() > 1 ? 1 : 0; i < (int) m.size(); i++)
+      lua_pushlstring(L, m[i].first, m[i].length());
+    return n;
+  }
+
+  // for a, b in re:gmatch(text) do ... end, like string.gmatch
+  int raw_gmatch(lua_State *L) {
+    LuaType<T>::todata(L, 1);
+    luaL_checkstring(L, 2);
+    lua_settop(L, 2);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, raw_gmatch_step, 3);
+    return 1;
+  }
+
+  static const luaL_Reg funcs[] = {
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg methods[] = {
+    { "match", raw_match },
+    { "search", raw_search },
+    { "find", raw_find },
+    { "capture", raw_capture },
+    { "replace", WRAP(replace) },
+    { "gmatch", raw_gmatch },
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg vars_get[] = {
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg vars_set[] = {
+    { NULL, NULL },
+  };
+}
+
+namespace PatternSetReg {
+  using T = PatternSet;
+
+  // rime_api.pattern_set(patterns[, options])
+  // patterns: literal strings, or Regex objects;
+  // options.regex: take strings as regexes, compiled with options.flags
+  int raw_make(lua_State *L) {
+    C_State C;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    bool regex = false;
+    string &flags = C.alloc<string>();
+    if (lua_istable(L, 2)) {
+      lua_getfield(L, 2, "regex");
+      regex = lua_toboolean(L, -1);
+      lua_getfield(L, 2, "flags");
+      if (lua_isstring(L, -1))
+        flags = lua_tostring(L, -1);
+      lua_pop(L, 2);
+    }
+    an<T> &set = C.alloc<an<T>>(New<T>());
+    const int n = (int) lua_rawlen(L, 1);
+    for (int i = 1; i <= n; i++) {
+      lua_rawgeti(L, 1, i);
+      if (lua_type(L, -1) == LUA_TSTRING) {
+        if (regex) {
+          auto re = compile(lua_tostring(L, -1), flags);
+          if (!re) {
+            lua_pushnil(L);
+            return 1;
+          }
+          set->AddRegex(*re);
+        } else {
+          set->AddLiteral(lua_tostring(L, -1));
+        }
+      } else {
+        set->AddRegex(LuaType<boost::regex>::todata(L, -1));
+      }
+      lua_pop(L, 1);
+    }
+    LuaType<an<T>>::pushdata(L, set);
+    return 1;
+  }
+
+  void push_indices(lua_State *L, const vector<int> &indices) {
+    lua_createtable(L, (int) indices.size(), 0);
+    for (size_t i = 0; i < indices.size(); i++) {
+      lua_pushinteger(L, indices[i] + 1);
+      lua_rawseti(L, -2, (int) i + 1);
+    }
+  }
+
+  // set:match(text) return the indices of the patterns found, ascending
+  int raw_match(lua_State *L) {
+    C_State C;
+    auto &set = LuaType<an<T>>::todata(L, 1);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    auto &indices = C.alloc<vector<int>>();
+    set->Match(text, text + len, &indices);
+    push_indices(L, indices);
+    return 1;
+  }
+
+  // set:match_many(texts) return the results of match() in texts order
+  int raw_match_many(lua_State *L) {
+    C_State C;
+    auto &set = LuaType<an<T>>::todata(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    auto &indices = C.alloc<vector<int>>();
+    const int n = (int) lua_rawlen(L, 2);
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; i++) {
+      lua_rawgeti(L, 2, i);
+      size_t len;
+      const char *text = lua_tolstring(L, -1, &len);
+      if (text)
+        set->Match(text, text + len, &indices);
+      else
+        indices.clear();
+      lua_pop(L, 1);
+      push_indices(L, indices);
+      lua_rawseti(L, -2, i);
+    }
+    return 1;
+  }
+
+  static const luaL_Reg funcs[] = {
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg methods[] = {
+    { "match", raw_match },
+    { "match_many", raw_match_many },
+    { "any", WRAPMEM(T::Any) },
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg vars_get[] = {
+    { "size", WRAPMEM(T::size) },
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg vars_set[] = {
+    { NULL, NULL },
+  };
+}
+
+namespace RimeApiReg {
+  // rime_api.regex_search(target, pattern)
+  int raw_regex_search(lua_State *L) {
+    size_t len;
+    const char *text = luaL_checklstring(L, 1, &len);
+    const char *pattern = luaL_checkstring(L, 2);
+    auto &m = last_match();
+    if (!boost::regex_search(text, text + len, m, cached_regex(pattern)))
+      return 0;
+    push_submatches(L, m);
+    return 1;
+  }
+
+  // rime_api.regex_match(target, pattern)
+  int raw_regex_match(lua_State *L) {
+    size_t len;
+    const char *text = luaL_checklstring(L, 1, &len);
+    const char *pattern = luaL_checkstring(L, 2);
+    lua_pushboolean(L,
+                    boost::regex_match(text, text + len, cached_regex(pattern)));
+    return 1;
+  }
+
+  string regex_replace(const string &target, const string &pattern,
+                       const string &fmt) {
+    return boost::regex_replace(target, cached_regex(pattern), fmt);
+  }
+
+  static const luaL_Reg funcs[] = {
+    { "regex", WRAP(RegexReg::make) },
+    { "pattern_set", PatternSetReg::raw_make },
+    { "regex_match", raw_regex_match },
+    { "regex_search", raw_regex_search },
+    { "regex_replace", WRAP(regex_replace) },
+    { NULL, NULL },
+  };
+}
+
+}
+
+void LUAWRAPPER_LOCAL regex_init(lua_State *L) {
+  EXPORT_TYPE(RegexReg, L);
+  EXPORT(PatternSetReg, L);
+  lua_getglobal(L, "rime_api");
+  if (lua_istable(L, -1))
+    luaL_setfuncs(L, RimeApiReg::funcs, 0);
+  lua_pop(L, 1);
+}
@@ -0,0 +1,226 @@
+#ifndef SHARED_CACHE_H
+#define SHARED_CACHE_H
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// modification time of a file at a UTF-8 path, 0 if it is missing
+// or cannot be read
+#ifdef _WIN32
+inline std::time_t file_mtime(const std::string &path) {
+  int n = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+  if (n <= 0)
+    return 0;
+  std::wstring wpath(n, L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], n);
+  struct _stat64 st;
+  return _wstat64(wpath.c_str(), &st) == 0 ? st.st_mtime : 0;
+}
+#else
+inline std::time_t file_mtime(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+}
+#endif
+
+// Process-wide instances of T shared by key.
+// An instance no one else holds is dropped after being idle for
+// idle_timeout(), at once if that is 0; it stays loaded while in use.
+// Idle instances are only looked for on get(), usage(), sweep() and
+// timeout changes, so dropping them is best-effort.
+template <typename T>
+class SharedCache {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  struct Usage {
+    std::string key;
+    long refs;  // holders besides the cache
+    size_t size;  // bytes, 0 if unknown
+    double idle;  // seconds
+  };
+
+  static SharedCache &instance() {
+    static SharedCache cache;
+    return cache;
+  }
+
+  // the instance of key, made by load() if there is none
+  // or valid() rejects it; a null result of load() is not kept.
+  // load() runs unlocked: callers of the same key wait for it,
+  // other keys are not blocked.
+  std::shared_ptr<T> get(
+      const std::string &key,
+      const std::function<std::shared_ptr<T>()> &load,
+      const std::function<bool(const T &)> &valid = nullptr) {
+    return Get(key, 0, load, valid);
+  }
+
+  // the same, replacing an instance loaded for another version,
+  // such as the mtime of the file it is loaded from
+  std::shared_ptr<T> get(const std::string &key, std::time_t version,
+                         const std::function<std::shared_ptr<T>()> &load) {
+    return Get(key, version, load, nullptr);
+  }
+
+  // whether an instance of key is loaded or being loaded
+  bool contains(const std::string &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    return loading_.count(key) || (it != entries_.end() && it->second.get());
+  }
+
+  std::vector<Usage> usage(const std::function<size_t(const T &)> &size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Sweep();
+    std::vector<Usage> r;
+    auto now = clock::now();
+    for (const auto &e : entries_) {
+      auto o = e.second.get();
+      if (!o)
+        continue;
+      std::chrono::duration<double> idle = now - e.second.last_used;
+      r.push_back({e.first, o.use_count() - (e.second.o ? 2 : 1),
+                   size ? size(*o) : 0, idle.count()});
+    }
+    return r;
+  }
+
+  std::chrono::seconds idle_timeout() const { return idle_timeout_; }
+
+  void set_idle_timeout(std::chrono::seconds timeout) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_timeout_ = timeout;
+    idle_timeout_set_ = true;
+    Sweep();
+  }
+
+  // sets the idle timeout unless set_idle_timeout() was called
+  void set_default_idle_timeout(std::chrono::seconds timeout) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (idle_timeout_set_)
+      return;
+    idle_timeout_ = timeout;
+    Sweep();
+  }
+
+  // drops the instances idle for too long
+  void sweep() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Sweep();
+  }
+
+  // drops every instance no one else holds
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (it->second.o.use_count() == 1)
+        it->second.o.reset();
+      if (it->second.w.expired())
+        it = entries_.erase(it);
+      else
+        ++it;
+    }
+  }
+
+ private:
+  struct Entry {
+    // not kept with a zero idle timeout, the instance then lives as
+    // long as its holders
+    std::shared_ptr<T> o;
+    std::weak_ptr<T> w;
+    std::time_t version;
+    clock::time_point last_used;
+
+    std::shared_ptr<T> get() const { return o ? o : w.lock(); }
+  };
+
+  std::shared_ptr<T> Get(const std::string &key, std::time_t version,
+                         const std::function<std::shared_ptr<T>()> &load,
+                         const std::function<bool(const T &)> &valid) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Sweep();
+    while (loading_.count(key))
+      loaded_.wait(lock);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      auto &e = it->second;
+      auto o = e.get();
+      if (o && e.version == version && (!valid || valid(*o))) {
+        if (idle_timeout_.count() > 0)
+          e.o = o;
+        e.last_used = clock::now();
+        return o;
+      }
+      // holders keep the stale instance
+      entries_.erase(it);
+    }
+    loading_.insert(key);
+    lock.unlock();
+    std::shared_ptr<T> o;
+    try {
+      o = load();
+    } catch (...) {
+      Loaded(key, nullptr, version);
+      throw;
+    }
+    Loaded(key, o, version);
+    return o;
+  }
+
+  void Loaded(const std::string &key, const std::shared_ptr<T> &o,
+              std::time_t version) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      loading_.erase(key);
+      if (o) {
+        auto keep = idle_timeout_.count() > 0 ? o : nullptr;
+        entries_[key] = {keep, o, version, clock::now()};
+      }
+    }
+    loaded_.notify_all();
+  }
+
+  void Sweep() {
+    auto now = clock::now();
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      auto &e = it->second;
+      if (idle_timeout_.count() == 0)
+        e.o.reset();
+      if (e.o ? e.o.use_count() > 1 : !e.w.expired()) {
+        // idle time counts from the last time it was seen in use
+        e.last_used = now;
+        ++it;
+      } else if (!e.o || now - e.last_used >= idle_timeout_) {
+        it = entries_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  // keys being loaded
+  std::set<std::string> loading_;
+  std::condition_variable loaded_;
+  std::chrono::seconds idle_timeout_{300};
+  bool idle_timeout_set_ = false;
+};
+
+#endif /* SHARED_CACHE_H */
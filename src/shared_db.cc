@@ -0,0 +1,244 @@
+#include "shared_db.h"
+#include <map>
+#include <utility>
+
+namespace rime {
+
+namespace {
+
+std::mutex registry_mutex;
+std::map<std::pair<string, string>, weak<SharedDb::Entry>> registry;
+
+}  // namespace
+
+an<SharedDb> SharedDb::Get(const string &db_name, const string &db_class,
+                           double bloom_fp_rate) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  auto &slot = registry[{db_name, db_class}];
+  auto entry = slot.lock();
+  if (!entry) {
+    auto comp = Db::Require(db_class);
+    if (!comp) {
+      registry.erase({db_name, db_class});
+      return nullptr;
+    }
+    entry = New<Entry>();
+    entry->db.reset(comp->Create(db_name));
+    if (!entry->db) {
+      registry.erase({db_name, db_class});
+      return nullptr;
+    }
+    entry->tx = dynamic_cast<Transactional *>(entry->db.get());
+    slot = entry;
+    // forget handles gone since
+    for (auto it = registry.begin(); it != registry.end();) {
+      if (it->second.expired())
+        it = registry.erase(it);
+      else
+        ++it;
+    }
+  }
+  if (bloom_fp_rate > 0 && !As<BloomDb>(entry->db)) {
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    // other handles may be using the db
+    if (entry->readers || entry->writers)
+      LOG(WARNING) << "db " << db_name << " is open, not adding a bloom filter.";
+    else
+      entry->db = New<BloomDb>(entry->db, bloom_fp_rate);
+  }
+  return New<SharedDb>(entry);
+}
+
+SharedDb::SharedDb(an<Entry> entry)
+    : Db(DbPath<Db>::of(*entry->db), entry->db->name()), entry_(entry) {}
+
+SharedDb::~SharedDb() {
+  if (loaded())
+    Close();
+}
+
+size_t SharedDb::readers() const {
+  std::lock_guard<std::mutex> lock(entry_->mutex);
+  return entry_->readers;
+}
+
+size_t SharedDb::writers() const {
+  std::lock_guard<std::mutex> lock(entry_->mutex);
+  return entry_->writers;
+}
+
+bool SharedDb::Open() {
+  if (loaded() && !readonly())
+    return true;
+  std::lock_guard<std::mutex> io(entry_->io_mutex);
+  std::lock_guard<std::mutex> lock(entry_->mutex);
+  auto &db = entry_->db;
+  if (!db->loaded() && !db->Open())
+    return false;
+  if (db->readonly()) {
+    LOG(WARNING) << "db " << name() << " is open read-only.";
+    return false;
+  }
+  if (loaded())
+    --entry_->readers;
+  ++entry_->writers;
+  loaded_ = true;
+  readonly_ = false;
+  return true;
+}
+
+bool SharedDb::OpenReadOnly() {
+  if (loaded())
+    return readonly();
+  std::lock_guard<std::mutex> io(entry_->io_mutex);
+  std::lock_guard<std::mutex> lock(entry_->mutex);
+  auto &db = entry_->db;
+  // a missing db is not created for reading
+  if (!db->loaded() && !(db->Exists() && db->Open()) && !db->OpenReadOnly())
+    return false;
+  ++entry_->readers;
+  loaded_ = true;
+  readonly_ = true;
+  return true;
+}
+
+bool SharedDb::Close() {
+  if (!loaded())
+    return true;
+  AbortTransaction();
+  std::lock_guard<std::mutex> io(entry_->io_mutex);
+  std::lock_guard<std::mutex> lock(entry_->mutex);
+  if (readonly())
+    --entry_->readers;
+  else
+    --entry_->writers;
+  loaded_ = false;
+  readonly_ = false;
+  if (entry_->readers == 0 && entry_->writers == 0)
+    return entry_->db->Close();
+  return true;
+}
+
+bool SharedDb::Backup(const db_path &snapshot_file) {
+  if (!loaded())
+    return false;
+  std::lock_guard<std::mutex> io(entry_->io_mutex);
+  return entry_->db->Backup(snapshot_file);
+}
+
+bool SharedDb::Restore(const db_path &snapshot_file) {
+  if (!loaded() || readonly())
+    return false;
+  std::lock_guard<std::mutex> io(entry_->io_mutex);
+  std::unique_lock<std::mutex> lock(entry_->mutex);
+  return AwaitTransaction(lock) &&
+         Changed(entry_->db->Restore(snapshot_file));
+}
+
+bool SharedDb::CreateMetadata() {
+  if (!loaded() || readonly())
+    return false;
+  std::unique_lock<std::mutex> lock(entry_->mutex);
+  return AwaitTransaction(lock) && entry_->db->CreateMetadata();
+}
+
+bool SharedDb::MetaFetch(const string &key, string *value) {
+  return loaded() && entry_->db->MetaFetch(key, value);
+}
+
+bool SharedDb::MetaUpdate(const string &key, const string &value) {
+  if (!loaded() || readonly())
+    return false;
+  std::unique_lock<std::mutex> lock(entry_->mutex);
+  return AwaitTransaction(lock) && entry_->db->MetaUpdate(key, value);
+}
+
+an<DbAccessor> SharedDb::QueryMetadata() {
+  return loaded() ? entry_->db->QueryMetadata() : nullptr;
+}
+
+an<DbAccessor> SharedDb::QueryAll() {
+  return loaded() ? entry_->db->QueryAll() : nullptr;
+}
+
+an<DbAccessor> SharedDb::Query(const string &key) {
+  return loaded() ? entry_->db->Query(key) : nullptr;
+}
+
+bool SharedDb::Fetch(const string &key, string *value) {
+  return loaded() && entry_->db->Fetch(key, value);
+}
+
+bool SharedDb::Update(const string &key, const string &value) {
+  if (!loaded() || readonly())
+    return false;
+  std::unique_lock<std::mutex> lock(entry_->mutex);
+  return AwaitTransaction(lock) && Changed(entry_->db->Update(key, value));
+}
+
+bool SharedDb::Erase(const string &key) {
+  if (!loaded() || readonly())
+    return false;
+  std::unique_lock<std::mutex> lock(entry_->mutex);
+  return AwaitTransaction(lock) && Changed(entry_->db->Erase(key));
+}
+
+// called with entry_->mutex held
+bool SharedDb::Changed(bool ok) const {
+  if (ok)
+    ++entry_->generation;
+  return ok;
+}
+
+// Waits until no other handle is in a transaction of the shared db.
+// Fails if that handle is in use on this thread, which could not end the
+// transaction while waiting.
+bool SharedDb::AwaitTransaction(std::unique_lock<std::mutex> &lock) const {
+  while (entry_->tx_owner && entry_->tx_owner != this) {
+    if (entry_->tx_thread == std::this_thread::get_id())
+      return false;
+    entry_->tx_done.wait(lock);
+  }
+  return true;
+}
+
+bool SharedDb::BeginTransaction() {
+  auto tx = entry_->tx;
+  if (!tx || !loaded() || readonly() || in_transaction())
+    return false;
+  std::unique_lock<std::mutex> lock(entry_->mutex);
+  if (!AwaitTransaction(lock) || !tx->BeginTransaction())
+    return false;
+  entry_->tx_owner = this;
+  entry_->tx_thread = std::this_thread::get_id();
+  transaction_ = true;
+  return true;
+}
+
+// called with entry_->mutex held
+void SharedDb::EndTransaction() {
+  entry_->tx_owner = nullptr;
+  transaction_ = false;
+  entry_->tx_done.notify_all();
+}
+
+bool SharedDb::AbortTransaction() {
+  if (!in_transaction())
+    return false;
+  std::lock_guard<std::mutex> lock(entry_->mutex);
+  bool ok = entry_->tx->AbortTransaction();
+  Changed(true);
+  EndTransaction();
+  return ok;
+}
+
+bool SharedDb::CommitTransaction() {
+  if (!in_transaction())
+    return false;
+  std::lock_guard<std::mutex> lock(entry_->mutex);
+  bool ok = entry_->tx->CommitTransaction();
+  EndTransaction();
+  return ok;
+}
+
+}  // namespace rime
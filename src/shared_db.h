@@ -0,0 +1,95 @@
+#ifndef SHARED_DB_H
+#define SHARED_DB_H
+
+#include <rime/common.h>
+#include <rime/dict/db.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "bloom_db.h"
+#include "db_compat.h"
+
+namespace rime {
+
+// A handle to a Db shared by every caller asking for the same
+// (db_name, db_class) in this process.
+// Each handle is opened and closed on its own; the shared db is opened
+// with the first handle and closed with the last one. It is opened
+// read-write if it exists, even for a read-only handle, and is never
+// reopened under the handles using it, so a handle asking to write to a
+// db that could only be opened read-only fails.
+// Transactions are passed to the shared db if it supports them.
+// While one handle is in a transaction, writes through the others wait
+// for it to end, or fail if made on the thread that holds it.
+class SharedDb : public Db, public Transactional {
+ public:
+  struct Entry {
+    an<Db> db;
+    // the transactions of db, if it has them
+    Transactional *tx = nullptr;
+    // the handle in a transaction of db, and its thread
+    const SharedDb *tx_owner = nullptr;
+    std::thread::id tx_thread;
+    std::condition_variable tx_done;
+    std::mutex mutex;
+    // held for opening, closing, backing up and restoring db, and by an
+    // AsyncDb for each flush; taken before `mutex`
+    std::mutex io_mutex;
+    size_t readers = 0;
+    size_t writers = 0;
+    // bumped by every change to the records of db
+    std::atomic<uint64_t> generation{0};
+  };
+
+  // A positive `bloom_fp_rate` puts a BloomDb in front of the shared db,
+  // unless it is already open without one.
+  static an<SharedDb> Get(const string &db_name, const string &db_class,
+                          double bloom_fp_rate = 0);
+
+  explicit SharedDb(an<Entry> entry);
+  virtual ~SharedDb();
+
+  virtual bool Open();
+  virtual bool OpenReadOnly();
+  virtual bool Close();
+
+  virtual bool Backup(const db_path &snapshot_file);
+  virtual bool Restore(const db_path &snapshot_file);
+
+  virtual bool CreateMetadata();
+  virtual bool MetaFetch(const string &key, string *value);
+  virtual bool MetaUpdate(const string &key, const string &value);
+
+  virtual an<DbAccessor> QueryMetadata();
+  virtual an<DbAccessor> QueryAll();
+  virtual an<DbAccessor> Query(const string &key);
+  virtual bool Fetch(const string &key, string *value);
+  virtual bool Update(const string &key, const string &value);
+  virtual bool Erase(const string &key);
+
+  virtual bool BeginTransaction();
+  virtual bool AbortTransaction();
+  virtual bool CommitTransaction();
+
+  an<Db> db() const { return entry_->db; }
+  bool transactional() const { return entry_->tx != nullptr; }
+  std::mutex &io_mutex() const { return entry_->io_mutex; }
+  // changes whenever a handle writes to, restores or rolls back the
+  // shared db, for caches over a handle to drop what they hold
+  uint64_t generation() const { return entry_->generation; }
+  // open handles of the shared db
+  size_t readers() const;
+  size_t writers() const;
+
+ private:
+  bool AwaitTransaction(std::unique_lock<std::mutex> &lock) const;
+  void EndTransaction();
+  bool Changed(bool ok) const;
+
+  an<Entry> entry_;
+};
+
+}  // namespace rime
+
+#endif /* SHARED_DB_H */
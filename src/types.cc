@@ -19,11 +19,13 @@
 #include <rime/service.h>
 #include <rime/switcher.h>
 #include "lua_gears.h"
-#include <boost/regex.hpp>
+#include <algorithm>
 #include <chrono>
 
 #include "lib/lua_export_type.h"
 #include "optional.h"
+#include "lookup_many.h"
+#include "shared_cache.h"
 
 #define ENABLE_TYPES_EXT
 
@@ -382,6 +384,232 @@ namespace TranslationReg {
     return 2;
   }
 
+  // Native adapters: built from Lua, iterated entirely in C++.
+  class FilterTranslation : public Translation {
+  public:
+    using Pred = std::function<bool (const an<Candidate> &)>;
+
+    FilterTranslation(an<Translation> translation, Pred pred)
+      : translation_(translation), pred_(pred) {
+      Skip();
+    }
+
+    bool Next() {
+      if (exhausted())
+        return false;
+      translation_->Next();
+      return Skip();
+    }
+
+    an<Candidate> Peek() {
+      return exhausted() ? nullptr : translation_->Peek();
+    }
+
+  private:
+    bool Skip() {
+      while (!translation_->exhausted() && !pred_(translation_->Peek()))
+        translation_->Next();
+      set_exhausted(translation_->exhausted());
+      return !exhausted();
+    }
+
+    an<Translation> translation_;
+    Pred pred_;
+  };
+
+  class MapTranslation : public Translation {
+  public:
+    using Func = std::function<an<Candidate> (const an<Candidate> &)>;
+
+    MapTranslation(an<Translation> translation, Func func)
+      : translation_(translation), func_(func) {
+      set_exhausted(translation_->exhausted());
+    }
+
+    bool Next() {
+      if (exhausted())
+        return false;
+      translation_->Next();
+      c_.reset();
+      set_exhausted(translation_->exhausted());
+      return !exhausted();
+    }
+
+    an<Candidate> Peek() {
+      if (exhausted())
+        return nullptr;
+      if (!c_)
+        c_ = func_(translation_->Peek());
+      return c_;
+    }
+
+  private:
+    an<Translation> translation_;
+    Func func_;
+    an<Candidate> c_;
+  };
+
+  class TakeTranslation : public Translation {
+  public:
+    TakeTranslation(an<Translation> translation, size_t count)
+      : translation_(translation), count_(count) {
+      set_exhausted(translation_->exhausted() || count_ == 0);
+    }
+
+    bool Next() {
+      if (exhausted())
+        return false;
+      translation_->Next();
+      set_exhausted(translation_->exhausted() || --count_ == 0);
+      return !exhausted();
+    }
+
+    an<Candidate> Peek() {
+      return exhausted() ? nullptr : translation_->Peek();
+    }
+
+  private:
+    an<Translation> translation_;
+    size_t count_;
+  };
+
+  // Drops the first `count` candidates on construction, so exhausted()
+  // is accurate before the first peek.
+  class SkipTranslation : public Translation {
+  public:
+    SkipTranslation(an<Translation> translation, size_t count)
+      : translation_(translation) {
+      for (; count > 0 && !translation_->exhausted(); count--)
+        translation_->Next();
+      set_exhausted(translation_->exhausted());
+    }
+
+    bool Next() {
+      if (exhausted())
+        return false;
+      translation_->Next();
+      set_exhausted(translation_->exhausted());
+      return !exhausted();
+    }
+
+    an<Candidate> Peek() {
+      return exhausted() ? nullptr : translation_->Peek();
+    }
+
+  private:
+    an<Translation> translation_;
+  };
+
+  // Moves candidates of the given types to the front, keeping the
+  // original order otherwise. Looks at most `limit` candidates ahead
+  // (0 means the whole translation).
+  class PartitionTranslation : public Translation {
+  public:
+    PartitionTranslation(an<Translation> translation,
+                         const std::set<string> &types, size_t limit)
+      : translation_(translation), types_(types), limit_(limit) {
+      set_exhausted(translation_->exhausted());
+    }
+
+    bool Next() {
+      if (exhausted())
+        return false;
+      Prefetch();
+      if (!queue_.empty())
+        queue_.pop_front();
+      else
+        translation_->Next();
+      set_exhausted(queue_.empty() && translation_->exhausted());
+      return !exhausted();
+    }
+
+    an<Candidate> Peek() {
+      if (exhausted())
+        return nullptr;
+      Prefetch();
+      return queue_.empty() ? translation_->Peek() : queue_.front();
+    }
+
+  private:
+    void Prefetch() {
+      if (prefetched_)
+        return;
+      prefetched_ = true;
+      CandidateQueue rest;
+      for (size_t n = 0; !translation_->exhausted() && (limit_ == 0 || n < limit_); n++) {
+        auto cand = translation_->Peek();
+        (types_.count(cand->type()) ? queue_ : rest).push_back(cand);
+        translation_->Next();
+      }
+      queue_.splice(queue_.end(), rest);
+    }
+
+    an<Translation> translation_;
+    std::set<string> types_;
+    size_t limit_;
+    bool prefetched_ = false;
+    CandidateQueue queue_;
+  };
+
+  // t:filter_by_set(Set{...} [, keep])
+  // drops candidates whose text is in the set, or keeps only them if keep
+  an<T> filter_by_set(an<T> t, std::set<string> texts, bool keep) {
+    auto set = New<std::set<string>>(std::move(texts));
+    return New<FilterTranslation>(t, [set, keep](const an<Candidate> &cand) {
+      return (set->count(cand->text()) > 0) == keep;
+    });
+  }
+
+  // t:map_comment(table | ReverseDb)
+  // replaces the comment with the value found for the candidate text
+  int raw_map_comment(lua_State *L) {
+    an<T> t = LuaType<an<T>>::todata(L, 1);
+    MapTranslation::Func func;
+    if (lua_istable(L, 2)) {
+      auto dict = New<hash_map<string, string>>();
+      lua_pushnil(L);
+      while (lua_next(L, 2) != 0) {
+        if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1))
+          (*dict)[lua_tostring(L, -2)] = lua_tostring(L, -1);
+        lua_pop(L, 1);
+      }
+      func = [dict](const an<Candidate> &cand) -> an<Candidate> {
+        auto it = dict->find(cand->text());
+        if (it == dict->end())
+          return cand;
+        return New<ShadowCandidate>(cand, cand->type(), string(), it->second);
+      };
+    } else {
+      an<ReverseDb> db = LuaType<an<ReverseDb>>::todata(L, 2);
+      func = [db](const an<Candidate> &cand) -> an<Candidate> {
+        string comment;
+        if (!db->Lookup(cand->text(), &comment))
+          return cand;
+        return New<ShadowCandidate>(cand, cand->type(), string(), comment);
+      };
+    }
+    an<T> r = New<MapTranslation>(t, func);
+    LuaType<an<T>>::pushdata(L, r);
+    return 1;
+  }
+
+  an<T> take(an<T> t, size_t count) {
+    return New<TakeTranslation>(t, count);
+  }
+
+  an<T> skip(an<T> t, size_t count) {
+    return New<SkipTranslation>(t, count);
+  }
+
+  an<T> dedup_by_text(an<T> t) {
+    return New<DistinctTranslation>(t);
+  }
+
+  an<T> stable_partition_by_type(an<T> t, std::set<string> types,
+                                 optional<size_t> limit) {
+    return New<PartitionTranslation>(t, types, limit ? *limit : 0);
+  }
+
   static const luaL_Reg funcs[] = {
     { "Translation", raw_make },
     { NULL, NULL },
@@ -389,6 +617,12 @@ namespace TranslationReg {
 
   static const luaL_Reg methods[] = {
     { "iter", raw_iter },
+    { "filter_by_set", WRAP(filter_by_set) },
+    { "map_comment", raw_map_comment },
+    { "take", WRAP(take) },
+    { "skip", WRAP(skip) },
+    { "dedup_by_text", WRAP(dedup_by_text) },
+    { "stable_partition_by_type", WRAP(stable_partition_by_type) },
     { NULL, NULL },
   };
 
@@ -405,10 +639,19 @@ namespace TranslationReg {
 namespace ReverseDbReg {
   using T = ReverseDb;
 
+  // shared by resolved path until the file changes;
+  // a db failing to load is not shared
   an<T> make(const string &file) {
-    an<T> db = COMPAT<Deployer>::new_ReverseDb(file);
-    db->Load();
-    return db;
+    an<T> failed;
+    auto key = COMPAT<Deployer>::get_user_data_dir() + "/" + file;
+    auto db = SharedCache<T>::instance().get(key, file_mtime(key), [&]() -> an<T> {
+      an<T> db = COMPAT<Deployer>::new_ReverseDb(file);
+      if (db->Load())
+        return db;
+      failed = db;
+      return {};
+    });
+    return db ? db : failed;
   }
 
   string lookup(T &db, const string &key) {
@@ -419,6 +662,14 @@ namespace ReverseDbReg {
       return string("");
   }
 
+  // lookup_many(keys | candidates[, options])
+  int raw_lookup_many(lua_State *L) {
+    T &db = LuaType<T &>::todata(L, 1);
+    return ::raw_lookup_many(L, [&db](const string &key, string *res) {
+      return db.Lookup(key, res);
+    });
+  }
+
   static const luaL_Reg funcs[] = {
     { "ReverseDb", WRAP(make) },
     { NULL, NULL },
@@ -426,6 +677,7 @@ namespace ReverseDbReg {
 
   static const luaL_Reg methods[] = {
     { "lookup", WRAP(lookup) },
+    { "lookup_many", raw_lookup_many },
     { NULL, NULL },
   };
 
@@ -1389,6 +1641,109 @@ namespace ConfigReg {
     return t.SaveToFile(COMPAT<Deployer>::to_path(f));
   }
 
+  // a map or list as a table, a scalar as a string, nil if null
+  void push_item(lua_State *L, const an<ConfigItem> &item) {
+    if (!lua_checkstack(L, 3)) {
+      lua_pushnil(L);
+      return;
+    }
+    if (auto value = As<ConfigValue>(item)) {
+      const string &str = value->str();
+      lua_pushlstring(L, str.data(), str.size());
+    } else if (auto list = As<ConfigList>(item)) {
+      lua_createtable(L, (int) list->size(), 0);
+      for (size_t i = 0; i < list->size(); i++) {
+        push_item(L, list->GetAt(i));
+        lua_rawseti(L, -2, (int) i + 1);
+      }
+    } else if (auto map = As<ConfigMap>(item)) {
+      lua_createtable(L, 0, 0);
+      for (const auto &entry : *map) {
+        push_item(L, entry.second);
+        lua_setfield(L, -2, entry.first.c_str());
+      }
+    } else {
+      lua_pushnil(L);
+    }
+  }
+
+  // config:to_table(path) return the subtree at path, nil if there is none
+  int raw_to_table(lua_State *L) {
+    C_State C;
+    T &t = LuaType<T &>::todata(L, 1);
+    const string &path = LuaType<string>::todata(L, 2, &C);
+    auto &item = C.alloc<an<ConfigItem>>(t.GetItem(path));
+    push_item(L, item);
+    return 1;
+  }
+
+  // a table with an array part becomes a list, other tables maps with
+  // their string keys, strings, numbers and booleans scalars;
+  // nullptr for other values and tables nested too deep
+  an<ConfigItem> to_item(lua_State *L, int i, int depth) {
+    const int kMaxDepth = 64;
+    switch (lua_type(L, i)) {
+      case LUA_TSTRING:
+      case LUA_TNUMBER: {
+        size_t len;
+        lua_pushvalue(L, i);
+        const char *str = lua_tolstring(L, -1, &len);
+        an<ConfigItem> value = New<ConfigValue>(string(str, len));
+        lua_pop(L, 1);
+        return value;
+      }
+      case LUA_TBOOLEAN:
+        return New<ConfigValue>((bool) lua_toboolean(L, i));
+      case LUA_TTABLE:
+        break;
+      default:
+        return nullptr;
+    }
+    if (depth >= kMaxDepth || !lua_checkstack(L, 3))
+      return nullptr;
+    if (i < 0)
+      i = lua_gettop(L) + i + 1;
+    const int n = (int) lua_rawlen(L, i);
+    if (n > 0) {
+      auto list = New<ConfigList>();
+      for (int k = 1; k <= n; k++) {
+        lua_rawgeti(L, i, k);
+        auto item = to_item(L, -1, depth + 1);
+        lua_pop(L, 1);
+        if (!item)
+          return nullptr;
+        list->Append(item);
+      }
+      return list;
+    }
+    auto map = New<ConfigMap>();
+    lua_pushnil(L);
+    while (lua_next(L, i)) {
+      if (lua_type(L, -2) == LUA_TSTRING) {
+        auto item = to_item(L, -1, depth + 1);
+        if (!item) {
+          lua_pop(L, 2);
+          return nullptr;
+        }
+        map->Set(lua_tostring(L, -2), item);
+      }
+      lua_pop(L, 1);
+    }
+    return map;
+  }
+
+  // config:set_table(path, value) replaces the subtree at path with value,
+  // converted as to_item()
+  int raw_set_table(lua_State *L) {
+    C_State C;
+    T &t = LuaType<T &>::todata(L, 1);
+    const string &path = LuaType<string>::todata(L, 2, &C);
+    luaL_checkany(L, 3);
+    auto &item = C.alloc<an<ConfigItem>>(to_item(L, 3, 0));
+    lua_pushboolean(L, item && t.SetItem(path, item));
+    return 1;
+  }
+
   static const luaL_Reg funcs[] = {
     { "Config", (raw_make)},
     { NULL, NULL },
@@ -1433,6 +1788,9 @@ namespace ConfigReg {
 
     { "get_list_size", WRAPMEM(T::GetListSize) },
 
+    { "to_table", raw_to_table },
+    { "set_table", raw_set_table },
+
     //RIME_API bool SetItem(const string& path, an<ConfigItem> item);
     { NULL, NULL },
   };
@@ -1446,12 +1804,39 @@ namespace ConfigReg {
   };
 }
 
+// Merges the firings of a signal during a key into one call of f with
+// the latest arguments, made before a lua_processor handles the next key.
+template<typename ... I>
+static std::function<void (I...)> coalesced(
+    Lua *lua, std::function<void (I...)> f) {
+  auto pending = std::make_shared<std::function<void ()>>();
+  return [lua, f, pending](I... i) {
+    bool queued = (bool) *pending;
+    *pending = [f, i...]() { f(i...); };
+    if (queued)
+      return;
+    // skipped if the slot is gone with its signal
+    std::weak_ptr<std::function<void ()>> weak = pending;
+    lua->defer([weak]() {
+      auto p = weak.lock();
+      if (!p || !*p)
+        return;
+      auto call = std::move(*p);
+      *p = nullptr;
+      call();
+    });
+  };
+}
+
+// notifier:connect(f[, priority][, options])
+// options.coalesce: calls f once per key with the latest arguments,
+// before a lua_processor handles the next key, instead of on every firing
 template<typename T, typename ... I>
 static int raw_connect(lua_State *L) {
   Lua *lua = Lua::from_state(L);
   T & t = LuaType<T &>::todata(L, 1);
   an<LuaObj> o = LuaObj::todata(L, 2);
-  auto f = [lua, o](I... i) {
+  std::function<void (I...)> f = [lua, o](I... i) {
     auto r = lua->void_call<an<LuaObj>, Context *>(o, i...);
     if (!r.ok()) {
                  auto e = r.get_err();
@@ -1459,7 +1844,16 @@ static int raw_connect(lua_State *L) {
     }
   };
 
-  auto c = (lua_gettop(L) > 2) ? t.connect(lua_tointeger(L, 3), f) : t.connect(f);
+  bool has_priority = lua_isnumber(L, 3);
+  int options = lua_istable(L, 3) ? 3 : 4;
+  if (lua_istable(L, options)) {
+    lua_getfield(L, options, "coalesce");
+    if (lua_toboolean(L, -1))
+      f = coalesced<I...>(lua, f);
+    lua_pop(L, 1);
+  }
+
+  auto c = has_priority ? t.connect(lua_tointeger(L, 3), f) : t.connect(f);
   LuaType<boost::signals2::connection>::pushdata(L, c);
   return 1;
 }
@@ -2380,31 +2774,50 @@ namespace RimeApiReg {
     return millis.count();
   }
 
-// boost::regex api
-  optional<std::vector<string>> regex_search(
-      const string &target ,const string &pattern )
-  {
-    boost::regex reg(pattern);
-    boost::smatch sm;
-    std::vector<string> res;
-    if ( boost::regex_search(target,sm,reg)) {
-      for (auto str : sm)
-        res.push_back(str);
-      return res;
+  template <typename T>
+  void push_usage(lua_State *L, const char *kind,
+                  const std::vector<typename SharedCache<T>::Usage> &usage) {
+    for (const auto &u : usage) {
+      lua_createtable(L, 0, 5);
+      lua_pushstring(L, kind);
+      lua_setfield(L, -2, "kind");
+      lua_pushstring(L, u.key.c_str());
+      lua_setfield(L, -2, "key");
+      lua_pushinteger(L, u.refs);
+      lua_setfield(L, -2, "refs");
+      lua_pushinteger(L, (lua_Integer) u.size);
+      lua_setfield(L, -2, "size");
+      lua_pushnumber(L, u.idle);
+      lua_setfield(L, -2, "idle");
+      lua_rawseti(L, -2, (lua_Integer) lua_rawlen(L, -2) + 1);
     }
-    return {}; // return nil
   }
 
-  bool regex_match(const string &target, const string &pattern)
-  {
-    boost::regex reg(pattern);
-    return boost::regex_match(target, reg);
+  // dict_cache_usage() return { { kind, key, refs, size, idle }, ... }
+  // of the shared ReverseDb and ReverseLookup instances
+  int raw_dict_cache_usage(lua_State *L) {
+    auto dbs = SharedCache<ReverseDb>::instance().usage(
+        [](const ReverseDb &db) { return db.capacity(); });
+    auto dicts = SharedCache<ReverseLookupDictionary>::instance().usage(nullptr);
+    lua_createtable(L, (int) (dbs.size() + dicts.size()), 0);
+    push_usage<ReverseDb>(L, "ReverseDb", dbs);
+    push_usage<ReverseLookupDictionary>(L, "ReverseLookup", dicts);
+    return 1;
   }
 
-  string regex_replace(const string &target, const string &pattern, const string &fmt)
-  {
-    boost::regex reg(pattern);
-    return boost::regex_replace(target, reg, fmt);
+  // seconds an unused ReverseDb or ReverseLookup stays loaded
+  void set_dict_cache_idle(int seconds) {
+    std::chrono::seconds timeout(std::max(0, seconds));
+    SharedCache<ReverseDb>::instance().set_idle_timeout(timeout);
+    SharedCache<ReverseLookupDictionary>::instance().set_idle_timeout(timeout);
+  }
+
+  // rime_api.intern_candidates([enable])
+  // pushes the same an<Candidate> as the same userdata while it is alive
+  int raw_intern_candidates(lua_State *L) {
+    bool enable = lua_isnone(L, 1) || lua_toboolean(L, 1);
+    LuaType<an<Candidate>>::set_intern(L, enable);
+    return 0;
   }
 
   static const luaL_Reg funcs[]= {
@@ -2417,9 +2830,9 @@ namespace RimeApiReg {
     { "get_distribution_version", WRAP(get_distribution_version) },
     { "get_user_id", WRAP(get_user_id) },
     { "get_time_ms", WRAP(get_time_ms) },
-    { "regex_match", WRAP(regex_match) },
-    { "regex_search", WRAP(regex_search) },
-    { "regex_replace", WRAP(regex_replace) },
+    { "intern_candidates", raw_intern_candidates },
+    { "dict_cache_usage", raw_dict_cache_usage },
+    { "set_dict_cache_idle", WRAP(set_dict_cache_idle) },
     { NULL, NULL },
   };
 
@@ -2427,6 +2840,15 @@ namespace RimeApiReg {
     lua_createtable(L, 0, 0);
     luaL_setfuncs(L, funcs, 0);
     lua_setglobal(L, "rime_api");
+#ifdef _WIN32
+    // a mapped file left open blocks rebuilding it on deploy,
+    // so unused dictionaries are released at once unless a script
+    // asked otherwise
+    SharedCache<ReverseDb>::instance().set_default_idle_timeout(
+        std::chrono::seconds(0));
+    SharedCache<ReverseLookupDictionary>::instance().set_default_idle_timeout(
+        std::chrono::seconds(0));
+#endif
   }
 }
 
@@ -2467,8 +2889,14 @@ namespace SwitcherReg {
 
 }
 
+void rime::dict_cache_sweep() {
+  SharedCache<ReverseDb>::instance().sweep();
+  SharedCache<ReverseLookupDictionary>::instance().sweep();
+}
+
 void types_ext_init(lua_State *L);
 void opencc_init(lua_State *L);
+void regex_init(lua_State *L);
 
 void types_init(lua_State *L) {
   EXPORT(SegmentReg, L);
@@ -2518,4 +2946,5 @@ void types_init(lua_State *L) {
   EXPORT_UPTR_TYPE(SchemaReg, L);
 
   opencc_init(L);
+  regex_init(L);
 }
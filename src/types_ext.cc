@@ -11,6 +11,7 @@
 #include <rime/segmentor.h>
 #include <rime/translator.h>
 #include <rime/filter.h>
+#include <rime/service.h>
 #include <rime/dict/reverse_lookup_dictionary.h>
 #include <rime/dict/user_db.h>
 #include <rime/dict/user_dictionary.h>
@@ -18,6 +19,14 @@
 
 #include "lib/lua_export_type.h"
 #include "optional.h"
+#include "async_db.h"
+#include "cached_db.h"
+#include "shared_db.h"
+#include "lookup_many.h"
+#include "shared_cache.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <utility>
 
 using namespace rime;
@@ -40,6 +49,16 @@ struct COMPAT<T, void_t<decltype(std::declval<T>().name_space())>> {
   }
 };
 
+// Deployer paths are strings on old librime, rime::path since
+string path_string(const string &p) {
+  return p;
+}
+
+template<typename P>
+string path_string(const P &p) {
+  return p.string();
+}
+
 // fallback version of file_path() if librime is old
 template<typename> struct void_t1 { using t = int; };
 template<typename T, typename void_t1<decltype(std::declval<T>().file_name())>::t = 0>
@@ -159,13 +178,27 @@ namespace ReverseLookupDictionaryReg {
   using T = ReverseLookupDictionary;
   using C = ReverseLookupDictionaryComponent;
 
+  // mtime of the file librime loads for dict_name: the one built in the
+  // user data dir, else the prebuilt one in the shared data dir
+  std::time_t file_version(const string& dict_name) {
+    auto &deployer = Service::instance().deployer();
+    const string file = "/build/" + dict_name + ".reverse.bin";
+    std::time_t mtime = file_mtime(path_string(deployer.user_data_dir) + file);
+    return mtime ? mtime :
+      file_mtime(path_string(deployer.shared_data_dir) + file);
+  }
+
+  // shared by dict_name until its file changes
   an<T> make(const string& dict_name) {
-    if ( auto c = (C *) T::Require("reverse_lookup_dictionary")){
-      auto t = (an<T>) c->Create(dict_name);
-      if ( t  && t->Load())
-        return t;
-    };
-    return {};
+    return SharedCache<T>::instance().get(dict_name, file_version(dict_name),
+                                          [&]() -> an<T> {
+      if ( auto c = (C *) T::Require("reverse_lookup_dictionary")){
+        auto t = (an<T>) c->Create(dict_name);
+        if ( t  && t->Load())
+          return t;
+      };
+      return {};
+    });
   }
 
   string lookup(T& db, const string &key){
@@ -178,6 +211,22 @@ namespace ReverseLookupDictionaryReg {
     return ( db.LookupStems(key, &res) ) ? res : string("") ;
   }
 
+  // lookup_many(keys | candidates[, options])
+  int raw_lookup_many(lua_State *L) {
+    T &db = LuaType<T &>::todata(L, 1);
+    return ::raw_lookup_many(L, [&db](const string &key, string *res) {
+      return db.ReverseLookup(key, res);
+    });
+  }
+
+  // lookup_stems_many(keys | candidates[, options])
+  int raw_lookup_stems_many(lua_State *L) {
+    T &db = LuaType<T &>::todata(L, 1);
+    return ::raw_lookup_many(L, [&db](const string &key, string *res) {
+      return db.LookupStems(key, res);
+    });
+  }
+
   static const luaL_Reg funcs[] = {
     {"ReverseLookup",WRAP(make)},
     { NULL, NULL },
@@ -186,6 +235,8 @@ namespace ReverseLookupDictionaryReg {
   static const luaL_Reg methods[] = {
     {"lookup",WRAP(lookup)},
     {"lookup_stems",WRAP(lookup_stems)},
+    {"lookup_many", raw_lookup_many},
+    {"lookup_stems_many", raw_lookup_stems_many},
     { NULL, NULL },
   };
 
@@ -231,6 +282,113 @@ namespace DbAccessorReg{
     return 2;
   }
 
+  // fills the table at index t with up to n records:
+  // { key1, value1, key2, value2, ... }, or { key1, key2, ... } if keys_only.
+  // The scan ends at the first key that does not start with stop_prefix.
+  // return the number of records
+  int fill_batch(lua_State* L, T& a, lua_Integer n, int t, bool keys_only,
+                 const char* stop_prefix, size_t prefix_len) {
+    int width = keys_only ? 1 : 2;
+    int len = (int) lua_rawlen(L, t);
+    int count = 0;
+    string key, value;
+    while (count < n && a.GetNextRecord(&key, &value)) {
+      if (stop_prefix && key.compare(0, prefix_len, stop_prefix, prefix_len) != 0)
+        break;
+      int i = count * width;
+      lua_pushlstring(L, key.data(), key.size());
+      lua_rawseti(L, t, i + 1);
+      if (!keys_only) {
+        lua_pushlstring(L, value.data(), value.size());
+        lua_rawseti(L, t, i + 2);
+      }
+      ++count;
+    }
+    // drop what is left of the previous batch
+    for (int i = count * width + 1; i <= len; ++i) {
+      lua_pushnil(L);
+      lua_rawseti(L, t, i);
+    }
+    return count;
+  }
+
+  // reads { table = t, keys_only = bool, prefix = string } at index o
+  // and calls fill_batch, leaving the table on the top of the stack
+  int fill_batch_with(lua_State* L, T& a, lua_Integer n, int o) {
+    bool keys_only = false;
+    const char* prefix = NULL;
+    size_t prefix_len = 0;
+    if (lua_istable(L, o)) {
+      lua_getfield(L, o, "keys_only");
+      keys_only = lua_toboolean(L, -1);
+      lua_getfield(L, o, "prefix");
+      prefix = lua_tolstring(L, -1, &prefix_len);
+      lua_getfield(L, o, "table");
+      if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, (int) n * (keys_only ? 1 : 2), 0);
+      }
+    } else {
+      lua_createtable(L, (int) n * 2, 0);
+    }
+    // the prefix string stays on the stack below the table
+    return fill_batch(L, a, n, lua_gettop(L), keys_only, prefix, prefix_len);
+  }
+
+  // next_batch(n[, options]) return table, count
+  // options: { table = reused table, keys_only = bool, prefix = string }
+  int raw_next_batch(lua_State* L){
+    auto a = LuaType<an<T>>::todata(L, 1);
+    lua_Integer n = luaL_optinteger(L, 2, 64);
+    if (!a || n < 1)
+      return 0;
+    lua_settop(L, 3);
+    int count = fill_batch_with(L, *a, n, 3);
+    lua_pushinteger(L, count);
+    return 2;
+  }
+
+  // upvalues: accessor, n, options
+  int raw_batch_step(lua_State* L){
+    auto a = LuaType<an<T>>::todata(L, lua_upvalueindex(1));
+    lua_Integer n = lua_tointeger(L, lua_upvalueindex(2));
+    int count = fill_batch_with(L, *a, n, lua_upvalueindex(3));
+    if (count == 0)
+      return 0;
+    lua_pushinteger(L, count);
+    return 2;
+  }
+
+  // for batch, count in acc:iter_batch(n[, options]) do ... end
+  // options as next_batch(); the table is reused across batches
+  // unless options.table is given
+  int raw_iter_batch(lua_State* L){
+    LuaType<an<T>>::todata(L, 1);
+    lua_Integer n = luaL_optinteger(L, 2, 64);
+    if (n < 1)
+      return 0;
+    lua_settop(L, 3);
+    lua_pushinteger(L, n);
+    lua_replace(L, 2);
+    // a private copy of the options that holds the reused table
+    lua_createtable(L, 0, 3);
+    if (lua_istable(L, 3)) {
+      for (auto field : {"keys_only", "prefix", "table"}) {
+        lua_getfield(L, 3, field);
+        lua_setfield(L, 4, field);
+      }
+    }
+    lua_getfield(L, 4, "table");
+    if (!lua_istable(L, -1)) {
+      lua_createtable(L, (int) n * 2, 0);
+      lua_setfield(L, 4, "table");
+    }
+    lua_pop(L, 1);
+    lua_replace(L, 3);
+    lua_pushcclosure(L, raw_batch_step, 3);
+    return 1;
+  }
+
   static const luaL_Reg funcs[] = {
     { NULL, NULL },
   };
@@ -239,10 +397,86 @@ namespace DbAccessorReg{
     {"reset", WRAPMEM(T::Reset)},
     {"jump", WRAPMEM(T::Jump)},
     {"iter",raw_iter},
+    {"next_batch", raw_next_batch},
+    {"iter_batch", raw_iter_batch},
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg vars_get[] = {
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg vars_set[] = {
+    { NULL, NULL },
+  };
+}
+
+// a set of writes applied to a Db at once
+namespace DbBatchReg {
+  class DbBatch {
+  public:
+    DbBatch(an<Db> db) : db_(db) {}
+
+    void put(const string& key, const string& value) {
+      ops_.push_back({false, key, value});
+    }
+
+    void erase(const string& key) {
+      ops_.push_back({true, key, string()});
+    }
+
+    // Atomic only on dbs that can begin a transaction (userdb). Others
+    // (plain_userdb) get every write in turn; writes before a failed one
+    // stay, and commit returns false.
+    bool commit() {
+      auto tx = dynamic_cast<Transactional *>(db_.get());
+      bool batched = tx && !tx->in_transaction() && tx->BeginTransaction();
+      bool ok = true;
+      for (const auto &op : ops_) {
+        ok = (op.erase ? db_->Erase(op.key) : db_->Update(op.key, op.value)) && ok;
+        if (!ok && batched)
+          break;
+      }
+      if (batched)
+        ok = ok ? tx->CommitTransaction() : (tx->AbortTransaction(), false);
+      ops_.clear();
+      return ok;
+    }
+
+    void clear() {
+      ops_.clear();
+    }
+
+    size_t size() const {
+      return ops_.size();
+    }
+
+  private:
+    struct Op {
+      bool erase;
+      string key;
+      string value;
+    };
+    an<Db> db_;
+    vector<Op> ops_;
+  };
+
+  using T = DbBatch;
+
+  static const luaL_Reg funcs[] = {
+    { NULL, NULL },
+  };
+
+  static const luaL_Reg methods[] = {
+    {"put", WRAPMEM(T::put)},
+    {"erase", WRAPMEM(T::erase)},
+    {"commit", WRAPMEM(T::commit)},
+    {"clear", WRAPMEM(T::clear)},
     { NULL, NULL },
   };
 
   static const luaL_Reg vars_get[] = {
+    {"size", WRAPMEM(T::size)},
     { NULL, NULL },
   };
 
@@ -250,23 +484,297 @@ namespace DbAccessorReg{
     { NULL, NULL },
   };
 }
+
 namespace UserDbReg{
   using T = Db;
   using A = DbAccessor;
 
-  an<T> make(const string& db_name, const string& db_class) {
-    if (auto comp= Db::Require(db_class)) {
-      return an<T>(comp->Create(db_name));
+  struct Options {
+    bool async = false;
+    int flush_interval = 1000; // ms
+    size_t cache = 0; // entries
+    double bloom = 0; // false positive rate
+  };
+
+  // { async = bool, flush_interval = ms, cache = entries,
+  //   bloom = true | false positive rate }
+  Options options(lua_State *L, int i) {
+    Options o;
+    if (!lua_istable(L, i))
+      return o;
+    lua_getfield(L, i, "async");
+    o.async = lua_toboolean(L, -1);
+    lua_getfield(L, i, "flush_interval");
+    if (lua_isnumber(L, -1))
+      o.flush_interval = std::max(1, (int) lua_tointeger(L, -1));
+    lua_getfield(L, i, "cache");
+    if (lua_isnumber(L, -1))
+      o.cache = (size_t) std::max<lua_Integer>(0, lua_tointeger(L, -1));
+    lua_getfield(L, i, "bloom");
+    if (lua_isnumber(L, -1))
+      o.bloom = std::min(0.5, (double) lua_tonumber(L, -1));
+    else if (lua_toboolean(L, -1))
+      o.bloom = 0.01;
+    lua_pop(L, 4);
+    return o;
+  }
+
+  an<T> make(const string& db_name, const string& db_class,
+             const Options& o = Options()) {
+    auto shared = SharedDb::Get(db_name, db_class, o.bloom);
+    if (!shared)
+      return {};
+    an<T> db = shared;
+    // plain dbs are not safe to read while a worker writes them, and
+    // their writes stay in memory anyway
+    if (o.async && !shared->transactional())
+      LOG(WARNING) << "db " << db_name << " is not transactional, not writing it asynchronously.";
+    else if (o.async)
+      db = New<AsyncDb>(shared, std::chrono::milliseconds(o.flush_interval));
+    if (o.cache)
+      db = New<CachedDb>(db, o.cache, shared);
+    return db;
+  }
+
+  // UserDb(db_name, db_class[, options])
+  int raw_make(lua_State *L) {
+    C_State C;
+    const string& db_name = LuaType<string>::todata(L, 1, &C);
+    const string& db_class = LuaType<string>::todata(L, 2, &C);
+    an<T> db = make(db_name, db_class, options(L, 3));
+    LuaType<an<T>>::pushdata(L, db);
+    return 1;
+  }
+
+  // LevelDb(db_name[, options])
+  int raw_make_leveldb(lua_State *L) {
+    C_State C;
+    const string& db_name = LuaType<string>::todata(L, 1, &C);
+    an<T> db = make(db_name, "userdb", options(L, 2));
+    LuaType<an<T>>::pushdata(L, db);
+    return 1;
+  }
+
+  // TableDb(db_name[, options])
+  int raw_make_tabledb(lua_State *L) {
+    C_State C;
+    const string& db_name = LuaType<string>::todata(L, 1, &C);
+    an<T> db = make(db_name, "plain_userdb", options(L, 2));
+    LuaType<an<T>>::pushdata(L, db);
+    return 1;
+  }
+
+  // the first wrapper of type D in the layers made by make()
+  template <class D>
+  an<D> layer(an<T> t) {
+    while (t) {
+      if (auto d = As<D>(t))
+        return d;
+      if (auto p = As<ProxyDb>(t))
+        t = p->db();
+      else if (auto a = As<AsyncDb>(t))
+        t = a->db();
+      else if (auto s = As<SharedDb>(t))
+        t = s->db();
+      else
+        break;
     }
     return {};
   }
 
-  an<T> make_leveldb(const string& db_name) {
-    return make(db_name, "userdb");
+  // writes queued updates of an async db
+  void flush(an<T> t) {
+    if (auto async = layer<AsyncDb>(t))
+      async->Flush();
+  }
+
+  size_t pending(an<T> t) {
+    auto async = layer<AsyncDb>(t);
+    return async ? async->pending() : 0;
+  }
+
+  void clear_cache(an<T> t) {
+    if (auto cached = layer<CachedDb>(t))
+      cached->Clear();
+  }
+
+  size_t cache_hits(an<T> t) {
+    auto cached = layer<CachedDb>(t);
+    return cached ? cached->hits() : 0;
+  }
+
+  size_t cache_misses(an<T> t) {
+    auto cached = layer<CachedDb>(t);
+    return cached ? cached->misses() : 0;
+  }
+
+  size_t cache_size(an<T> t) {
+    auto cached = layer<CachedDb>(t);
+    return cached ? cached->size() : 0;
+  }
+
+  // fetch calls answered by the bloom filter alone
+  size_t bloom_skipped(an<T> t) {
+    auto bloom = layer<BloomDb>(t);
+    return bloom ? bloom->skipped() : 0;
   }
 
-  an<T> make_tabledb(const string& db_name) {
-    return make(db_name, "plain_userdb");
+  // calls the progress function at index f, if any, with count
+  bool report(lua_State *L, int f, size_t count) {
+    if (!lua_isfunction(L, f))
+      return true;
+    lua_pushvalue(L, f);
+    lua_pushinteger(L, (lua_Integer) count);
+    int status = lua_pcall(L, 1, 0, 0);
+    if (status != LUA_OK) {
+      LOG(ERROR) << "UserDb progress error(" << status << "): "
+                 << lua_tostring(L, -1);
+      lua_pop(L, 1);
+      return false;
+    }
+    return true;
+  }
+
+  int push_error(lua_State *L, const string& path, const char *e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path.c_str(), e);
+    return 2;
+  }
+
+  // import_tsv(path[, { batch = records, progress = function(count) }])
+  // reads key\tvalue lines, skipping empty ones and #comments;
+  // the value follows the last tab, as userdb keys are code\tphrase,
+  // committing every `batch` records if the db has transactions
+  // return the number of records written, or nil, error message
+  int raw_import_tsv(lua_State *L) {
+    C_State C;
+    an<T> t = LuaType<an<T>>::todata(L, 1);
+    const string& path = LuaType<string>::todata(L, 2, &C);
+    size_t batch = 10000;
+    lua_settop(L, 3);
+    if (lua_istable(L, 3)) {
+      lua_getfield(L, 3, "batch");
+      if (lua_isnumber(L, -1))
+        batch = (size_t) std::max<lua_Integer>(1, lua_tointeger(L, -1));
+      lua_getfield(L, 3, "progress");
+    } else {
+      lua_pushnil(L);
+      lua_pushnil(L);
+    }
+    const int progress = 5;
+    if (!t || !t->loaded() || t->readonly())
+      return push_error(L, path, "db is not open for writing");
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      return push_error(L, path, "cannot open file");
+
+    auto tx = dynamic_cast<Transactional *>(t.get());
+    bool batched = false;
+    size_t count = 0, pending = 0;
+    string line, key, value;
+    bool ok = true;
+    while (ok && std::getline(in, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (line.empty() || line[0] == '#')
+        continue;
+      size_t sep = line.rfind('\t');
+      if (sep == string::npos)
+        continue;
+      key.assign(line, 0, sep);
+      value.assign(line, sep + 1, string::npos);
+      if (pending == 0 && tx && !tx->in_transaction())
+        batched = tx->BeginTransaction();
+      if (!t->Update(key, value)) {
+        ok = false;
+        break;
+      }
+      if (++pending == batch) {
+        if (batched && !tx->CommitTransaction())
+          return push_error(L, path, "commit failed");
+        count += pending;
+        pending = 0;
+        ok = report(L, progress, count);
+      }
+    }
+    if (batched && pending) {
+      if (ok)
+        ok = tx->CommitTransaction();
+      else
+        tx->AbortTransaction();
+    }
+    if (!ok) {
+      // without transactions the failed batch is partly written
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: import stopped after %d records",
+                      path.c_str(), (int) (batched ? count : count + pending));
+      return 2;
+    }
+    count += pending;
+    report(L, progress, count);
+    lua_pushinteger(L, (lua_Integer) count);
+    return 1;
+  }
+
+  // whether import_tsv reads the record back as it is
+  bool tsv_safe(const string& key, const string& value) {
+    return !key.empty() && key[0] != '#' &&
+      key.find_first_of("\n\r") == string::npos &&
+      value.find_first_of("\t\n\r") == string::npos;
+  }
+
+  // export_tsv(path[, prefix[, progress]])
+  // writes key\tvalue lines, as read by import_tsv, of the records
+  // starting with prefix, calling progress(count) every 10000 records;
+  // records that would not read back (a tab or line break in the value,
+  // a line break or leading # in the key) are left out
+  // return the number of records written, or nil, error message
+  int raw_export_tsv(lua_State *L) {
+    C_State C;
+    an<T> t = LuaType<an<T>>::todata(L, 1);
+    const string& path = LuaType<string>::todata(L, 2, &C);
+    const string& prefix = lua_isstring(L, 3) ?
+      LuaType<string>::todata(L, 3, &C) : C.alloc<string>();
+    const int progress = 4;
+    if (!t || !t->loaded())
+      return push_error(L, path, "db is not open");
+    // metadata records are skipped by QueryAll()
+    auto a = prefix.empty() ? t->QueryAll() : t->Query(prefix);
+    if (!a)
+      return push_error(L, path, "cannot query db");
+    std::vector<char> buffer(1 << 16);
+    std::ofstream out;
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+      return push_error(L, path, "cannot open file");
+
+    size_t count = 0, skipped = 0;
+    string key, value;
+    bool ok = true;
+    while (ok && a->GetNextRecord(&key, &value)) {
+      if (!tsv_safe(key, value)) {
+        ++skipped;
+        continue;
+      }
+      out << key << '\t' << value << '\n';
+      if (++count % 10000 == 0)
+        ok = report(L, progress, count);
+    }
+    out.close();
+    if (out.fail())
+      return push_error(L, path, "write failed");
+    if (skipped)
+      LOG(WARNING) << "export_tsv " << path << ": left out " << skipped
+                   << " records that import_tsv would not read back.";
+    if (!ok || !report(L, progress, count)) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: export stopped after %d records",
+                      path.c_str(), (int) count);
+      return 2;
+    }
+    lua_pushinteger(L, (lua_Integer) count);
+    return 1;
   }
 
   optional<string> fetch(an<T> t, const string& key) {
@@ -276,10 +784,14 @@ namespace UserDbReg{
     return {};
   }
 
+  an<DbBatchReg::DbBatch> batch(an<T> t) {
+    return New<DbBatchReg::DbBatch>(t);
+  }
+
   static const luaL_Reg funcs[] = {
-    {"UserDb", WRAP(make)},// an<Db> LevelDb( db_file, db_name)
-    {"LevelDb", WRAP(make_leveldb)},// an<Db> LevelDb( db_file, db_name)
-    {"TableDb", WRAP(make_tabledb)},// Db UserDb( db_name, db_type:userdb|plain_userdb)
+    {"UserDb", raw_make},// Db UserDb( db_name, db_type:userdb|plain_userdb[, options])
+    {"LevelDb", raw_make_leveldb},// Db LevelDb( db_name[, options])
+    {"TableDb", raw_make_tabledb},// Db TableDb( db_name[, options])
     { NULL, NULL },
   };
 
@@ -291,6 +803,11 @@ namespace UserDbReg{
     {"fetch", WRAP(fetch)},  //   fetch(key) return value
     {"update", WRAPMEM(T, Update)}, // update(key,value) return bool
     {"erase", WRAPMEM(T, Erase)}, // erase(key) return bool
+    {"batch", WRAP(batch)}, // batch() return DbBatch
+    {"import_tsv", raw_import_tsv}, // import_tsv(path[, options]) return count
+    {"export_tsv", raw_export_tsv}, // export_tsv(path[, prefix[, progress]]) return count
+    {"flush", WRAP(flush)}, // flush() writes queued updates of an async db
+    {"clear_cache", WRAP(clear_cache)},
 
     {"loaded",WRAPMEM(T, loaded)},
     {"disable", WRAPMEM(T, disable)},
@@ -304,6 +821,11 @@ namespace UserDbReg{
     {"disabled",WRAPMEM(T, disabled)},
     {"name", WRAPMEM(T, name)},
     {"file_name", WRAP(get_UserDb_file_path_string<T>)},
+    {"pending", WRAP(pending)},
+    {"cache_hits", WRAP(cache_hits)},
+    {"cache_misses", WRAP(cache_misses)},
+    {"cache_size", WRAP(cache_size)},
+    {"bloom_skipped", WRAP(bloom_skipped)},
     { NULL, NULL },
   };
 
@@ -389,6 +911,7 @@ void LUAWRAPPER_LOCAL types_ext_init(lua_State *L) {
   EXPORT(FilterReg, L);
   EXPORT(ReverseLookupDictionaryReg, L);
   EXPORT(DbAccessorReg, L);
+  EXPORT(DbBatchReg, L);
   EXPORT(UserDbReg, L);
   ComponentReg::init(L);
   // add LtableTranslator ScriptTranslator in Component